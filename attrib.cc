@@ -19,110 +19,168 @@
  *
  **************************************************************************
  */
+#include <utility>
+#include <mutex>
 #include "geom.h"
 
-LayoutEdgeAttrib::attrib_list *LayoutEdgeAttrib::dup (attrib_list *l, long adj)
+/*-- interned marker names --*/
+static Hashtable *_le_names = NULL;	// name -> id
+static A_DECL (const char *, _le_ids);	// id -> name
+static std::mutex _le_lock;		// .rect files are read in parallel
+
+int LayoutEdgeAttrib::intern (const char *name)
 {
-  if (!l) return NULL;
-  LayoutEdgeAttrib::attrib_list *ret, *cur;
-  NEW (ret, LayoutEdgeAttrib::attrib_list);
-  ret->name = l->name;
-  ret->offset = l->offset + adj;
-  ret->next = NULL;
-  cur = ret;
-  while (l->next) {
-    NEW (cur->next, attrib_list);
-    cur = cur->next;
-    l = l->next;
-    cur->name = l->name;
-    cur->offset = l->offset + adj;
-    cur->next = NULL;
+  hash_bucket_t *b;
+  int id;
+
+  _le_lock.lock ();
+  if (!_le_names) {
+    _le_names = hash_new (8);
+    A_INIT (_le_ids);
+  }
+  b = hash_lookup (_le_names, name);
+  if (!b) {
+    b = hash_add (_le_names, name);
+    b->i = A_LEN (_le_ids);
+    A_NEW (_le_ids, const char *);
+    A_NEXT (_le_ids) = b->key;
+    A_INC (_le_ids);
   }
+  id = b->i;
+  _le_lock.unlock ();
+  return id;
+}
+
+const char *LayoutEdgeAttrib::name (int id)
+{
+  const char *ret;
+  _le_lock.lock ();
+  Assert (0 <= id && id < A_LEN (_le_ids), "Invalid marker id");
+  ret = _le_ids[id];
+  _le_lock.unlock ();
   return ret;
 }
 
+void LayoutEdgeAttrib::push (attrib_list *l, int id, long offset)
+{
+  if (!l->ext && l->n == LE_INLINE) {
+    l->max = 2*LE_INLINE;
+    MALLOC (l->ext, attrib, l->max);
+    for (int i=0; i < l->n; i++) {
+      l->ext[i] = l->inl[i];
+    }
+  }
+  else if (l->ext && l->n == l->max) {
+    l->max *= 2;
+    REALLOC (l->ext, attrib, l->max);
+  }
+  attrib &a = l->ext ? l->ext[l->n] : l->inl[l->n];
+  a.id = id;
+  a.offset = offset;
+  l->n++;
+}
+
+void LayoutEdgeAttrib::freelist (attrib_list *l)
+{
+  if (l->ext) {
+    FREE (l->ext);
+  }
+  init (l);
+}
+
+void LayoutEdgeAttrib::dup (attrib_list *to, attrib_list *from, long adj)
+{
+  if (to == from) {
+    adjust (to, adj);
+    return;
+  }
+  freelist (to);
+  for (int i=0; i < from->n; i++) {
+    push (to, (*from)[i].id, (*from)[i].offset + adj);
+  }
+}
+
 /*
-  Merge y into x.
-  Both lists have to be sorted by offset.
+  Merge y (shifted by adj) into x.
+  Both lists have to be sorted by offset. A marker in y that is
+  already in x at the same offset is dropped; otherwise markers from
+  y go before those in x with the same offset.
 */
-bool LayoutEdgeAttrib::merge (LayoutEdgeAttrib::attrib_list **x,
-			      LayoutEdgeAttrib::attrib_list *y)
+bool LayoutEdgeAttrib::merge (attrib_list *x, attrib_list *y, long adj)
 {
-  if (!*x) {
-    *x = y;
+  attrib_list res;
+  int i, j;
+
+  if (y->n == 0) {
     return true;
   }
-  attrib_list *prev, *cur;
-  prev = NULL;
-  cur = *x;
-  while (y) {
-    while (cur && cur->offset < y->offset) {
-      prev = cur;
-      cur = cur->next;
+  init (&res);
+  i = 0;
+  j = 0;
+  while (j < y->n) {
+    long yoff = (*y)[j].offset + adj;
+    while (i < x->n && (*x)[i].offset < yoff) {
+      push (&res, (*x)[i].id, (*x)[i].offset);
+      i++;
     }
-    if (!cur) {
-      prev->next = y;
-      cur = y;
-      y = y->next;
+    if (i < x->n && (*x)[i].offset == yoff && (*x)[i].id == (*y)[j].id) {
+      /* nothing to do */
     }
     else {
-      if (cur->offset == y->offset && strcmp (cur->name, y->name) == 0) {
-	/* nothing to do */
-	y = y->next;
-      }
-      else {
-	if (!prev) {
-	  prev = y;
-	  y = y->next;
-	  prev->next = cur;
-	  *x = prev;
-	}
-	else {
-	  prev->next = y;
-	  y = y->next;
-	  prev->next->next = cur;
-	  prev = prev->next;
-	}
-      }
+      push (&res, (*y)[j].id, yoff);
     }
+    j++;
+  }
+  while (i < x->n) {
+    push (&res, (*x)[i].id, (*x)[i].offset);
+    i++;
   }
+  freelist (x);
+  *x = res;
   return true;
 }
 
-void LayoutEdgeAttrib::freelist (LayoutEdgeAttrib::attrib_list *l) {
-  LayoutEdgeAttrib::attrib_list *tmp;
-  while (l) {
-    tmp = l;
-    l = l->next;
-    FREE (tmp);
-  }
+void LayoutEdgeAttrib::add (int e, const char *name, long offset)
+{
+  attrib_list tmp;
+  init (&tmp);
+  push (&tmp, intern (name), offset);
+  merge (_edge (e), &tmp);
 }
 
 
 void LayoutEdgeAttrib::print (FILE *fp, attrib_list *l)
 {
-  bool out = false;
-  if (l) {
-    out = true;
-    fprintf (fp, " >[");
-  }
-  while (l) {
-    fprintf (fp, " (%s %ld)", l->name, l->offset);
-    l = l->next;
+  if (!l || l->n == 0) {
+    return;
   }
-  if (out) {
-    fprintf (fp, " ]<");
+  fprintf (fp, " >[");
+  for (int i=0; i < l->n; i++) {
+    fprintf (fp, " (%s %ld)", l->name (i), (*l)[i].offset);
   }
+  fprintf (fp, " ]<");
 }
 
 
+/*
+ * Multi-deck alignment: every marker on the edge with fewer markers
+ * has to line up with a marker of the same name on the other
+ * edge. Each pair of markers with the same name votes for the shift
+ * that would line them up; a shift that gets a vote from every
+ * marker on the smaller edge is valid. If there are several (e.g. a
+ * single-height cell next to a multi-height one), the smallest one
+ * is picked.
+ */
 bool LayoutEdgeAttrib::align (attrib_list *l1, attrib_list *l2, long *amt)
 {
   // no attributes: works with offset 0
-  if (!l1 && !l2) {
+  if (l1->n == 0 && l2->n == 0) {
     *amt = 0;
     return true;
   }
+  if (l1->n == 0 || l2->n == 0) {
+    return false;
+  }
 #if 0
   printf ("l1: ");
   print (stdout, l1);
@@ -130,27 +188,97 @@ bool LayoutEdgeAttrib::align (attrib_list *l1, attrib_list *l2, long *amt)
   printf ("l2: "); print (stdout, l2);
   printf ("\n\n");
 #endif
-  bool shift_computed = false;
-  long shiftamt;
 
-  while (l1 && l2) {
-    if (strcmp (l1->name, l2->name) != 0) {
+  /* common case: one marker each */
+  if (l1->n == 1 && l2->n == 1) {
+    if ((*l1)[0].id != (*l2)[0].id) {
       return false;
     }
-    if (shift_computed) {
-      if (l2->offset + shiftamt != l1->offset) {
-	return false;
-      }
+    *amt = (*l1)[0].offset - (*l2)[0].offset;
+    return true;
+  }
+
+  attrib_list *big, *small;
+  int sign;
+  if (l2->n > l1->n) {
+    big = l2;
+    small = l1;
+    sign = -1;
+  }
+  else {
+    big = l1;
+    small = l2;
+    sign = 1;
+  }
+
+  /* markers on the larger edge, chained by name */
+  iHashtable *byid = ihash_new (4);
+  int *nxt;
+  MALLOC (nxt, int, big->n);
+  for (int i=big->n-1; i >= 0; i--) {
+    ihash_bucket_t *b = ihash_lookup (byid, (*big)[i].id);
+    if (!b) {
+      b = ihash_add (byid, (*big)[i].id);
+      b->i = -1;
     }
-    else {
-      shiftamt = l1->offset - l2->offset;
-      shift_computed = true;
+    nxt[i] = b->i;
+    b->i = i;
+  }
+
+  /* vote: the table maps a shift to its entry in tally; a bucket
+     only has room for one value */
+  struct vote {
+    int count;			// # of markers on the small edge for it
+    int last;			// last marker that voted for it
+  };
+  A_DECL (struct vote, tally);
+  A_INIT (tally);
+  iHashtable *votes = ihash_new (4);
+  bool found = false;
+  long best = 0;
+  for (int j=0; j < small->n; j++) {
+    ihash_bucket_t *b = ihash_lookup (byid, (*small)[j].id);
+    if (!b) {
+      // no marker with this name: can't line up
+      found = false;
+      break;
+    }
+    for (int i=b->i; i != -1; i = nxt[i]) {
+      long d = (*big)[i].offset - (*small)[j].offset;
+      ihash_bucket_t *v = ihash_lookup (votes, d);
+      if (!v) {
+	v = ihash_add (votes, d);
+	v->i = A_LEN (tally);
+	A_NEW (tally, struct vote);
+	A_NEXT (tally).count = 0;
+	A_NEXT (tally).last = -1;
+	A_INC (tally);
+      }
+      struct vote *t = &tally[v->i];
+      if (t->last == j) {
+	// already voted for this shift
+	continue;
+      }
+      t->last = j;
+      t->count++;
+      if (t->count == small->n) {
+	if (!found || (d < 0 ? -d : d) < (best < 0 ? -best : best) ||
+	    ((d < 0 ? -d : d) == (best < 0 ? -best : best) && d < best)) {
+	  best = d;
+	}
+	found = true;
+      }
     }
-    l1 = l1->next;
-    l2 = l2->next;
   }
-  if (l1 || l2) return false;
-  *amt = shiftamt;
+  ihash_free (votes);
+  A_FREE (tally);
+  ihash_free (byid);
+  FREE (nxt);
+
+  if (!found) {
+    return false;
+  }
+  *amt = sign*best;
   return true;
 }
 
@@ -158,73 +286,53 @@ bool LayoutEdgeAttrib::align (attrib_list *l1, attrib_list *l2, long *amt)
 LayoutEdgeAttrib *LayoutEdgeAttrib::Clone()
 {
   LayoutEdgeAttrib *ret = new LayoutEdgeAttrib();
-  if (_left) {
-    ret->_left = dup (_left);
-  }
-  if (_right) {
-    ret->_right = dup (_right);
-  }
-  if (_top) {
-    ret->_top = dup (_top);
-  }
-  if (_bot) {
-    ret->_bot = dup (_bot);
-  }
+  ret->mkCopy (*this);
   return ret;
 }
 
 
-LayoutEdgeAttrib::attrib_list *
-LayoutEdgeAttrib::flipsign (LayoutEdgeAttrib::attrib_list *x)
+/* negate the offsets; the list is reversed to keep it sorted */
+void LayoutEdgeAttrib::flipsign (attrib_list *x)
 {
-  if (!x) return NULL;
-  attrib_list *prev, *cur;
-  prev = NULL;
-  cur = x;
-  while (cur) {
-    attrib_list *tmp;
-
-    cur->offset = -cur->offset;
-    
-    tmp = cur->next;
-    cur->next = prev;
-    prev = cur;
-    cur = cur->next;
-  }
-  return prev;
+  int i, j;
+  for (i=0, j=x->n-1; i < j; i++, j--) {
+    std::swap ((*x)[i], (*x)[j]);
+  }
+  for (i=0; i < x->n; i++) {
+    (*x)[i].offset = -(*x)[i].offset;
+  }
 }
 
-void LayoutEdgeAttrib::adjust (LayoutEdgeAttrib::attrib_list *x, long adj)
+void LayoutEdgeAttrib::adjust (attrib_list *x, long adj)
 {
-  while (x) {
-    x->offset += adj;
-    x = x->next;
+  if (adj == 0) {
+    return;
+  }
+  for (int i=0; i < x->n; i++) {
+    (*x)[i].offset += adj;
   }
 }
 
 void LayoutEdgeAttrib::swaplr ()
 {
-  attrib_list *x;
-  x = _left; _left = _right; _right = x;
+  std::swap (_e[LE_LEFT], _e[LE_RIGHT]);
   // flip sign of top/bot attribs
-  _top = flipsign (_top);
-  _bot = flipsign (_bot);
+  flipsign (&_e[LE_TOP]);
+  flipsign (&_e[LE_BOT]);
 }
   
 void LayoutEdgeAttrib::swaptb ()
 {
-  attrib_list *x;
-  x = _top; _top = _bot; _bot = x;
+  std::swap (_e[LE_TOP], _e[LE_BOT]);
   // flip sign of left/right attrib
-  _left = flipsign (_left);
-  _right = flipsign (_right);
+  flipsign (&_e[LE_LEFT]);
+  flipsign (&_e[LE_RIGHT]);
 }
 
 void LayoutEdgeAttrib::swap45()
 {
-  attrib_list *x;
-  x = _left; _left = _bot; _bot = x;
-  x = _right; _right = _top; _top = x;
+  std::swap (_e[LE_LEFT], _e[LE_BOT]);
+  std::swap (_e[LE_RIGHT], _e[LE_TOP]);
 }
 
 
@@ -281,3 +389,61 @@ LayoutEdgeAttrib *LayoutEdgeAttrib::Clone (TransformMat *m)
   
   return le;
 }
+
+
+bool LayoutEdgeAttrib::mergeXform (int e, LayoutEdgeAttrib *src,
+				   TransformMat *m)
+{
+  long dx, dy, px, py;
+  int from[4];
+  bool neg[4];
+  int i;
+
+  if (m) {
+    m->apply (0, 0, &dx, &dy);
+    m->apply (1, 2, &px, &py);
+  }
+  else {
+    dx = 0;
+    dy = 0;
+    px = 1;
+    py = 2;
+  }
+  px -= dx;
+  py -= dy;
+
+  // track where each edge of the result comes from; this follows
+  // the swaps in Clone (m)
+  for (i=0; i < 4; i++) {
+    from[i] = i;
+    neg[i] = false;
+  }
+  if ((px < 0 ? -px : px) != 1) {
+    std::swap (from[LE_LEFT], from[LE_BOT]);
+    std::swap (from[LE_RIGHT], from[LE_TOP]);
+  }
+  if (px < 0) {
+    std::swap (from[LE_LEFT], from[LE_RIGHT]);
+    std::swap (neg[LE_LEFT], neg[LE_RIGHT]);
+    neg[LE_TOP] = !neg[LE_TOP];
+    neg[LE_BOT] = !neg[LE_BOT];
+  }
+  if (py < 0) {
+    std::swap (from[LE_TOP], from[LE_BOT]);
+    std::swap (neg[LE_TOP], neg[LE_BOT]);
+    neg[LE_LEFT] = !neg[LE_LEFT];
+    neg[LE_RIGHT] = !neg[LE_RIGHT];
+  }
+
+  attrib_list *x = src->edge (from[e]);
+  if (!neg[e]) {
+    return merge (_edge (e), x, (e == LE_TOP || e == LE_BOT) ? dx : dy);
+  }
+  attrib_list tmp;
+  init (&tmp);
+  dup (&tmp, x);
+  flipsign (&tmp);
+  merge (_edge (e), &tmp, (e == LE_TOP || e == LE_BOT) ? dx : dy);
+  freelist (&tmp);
+  return true;
+}
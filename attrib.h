@@ -28,45 +28,73 @@ class TransformMat;
  * These are used as alignment markers. They can be used for an umber
  * of different purposes, including multi-deck gridded cells.
  *
- * **Currently only using an attrib_list of length at most 1 until we
- *   include multi-deck support**
+ * An edge can have several markers (e.g. one per deck of a
+ * multi-height cell). Two edges align if each marker on the edge
+ * with fewer markers lines up with one of the same name on the
+ * other edge, using a single shift.
  *
  * Alignment marker offsets are in the local coordinate system of the
  * paint.
  *
+ * Marker names are interned: each distinct name gets an integer id,
+ * and name() maps it back.
+ *
  */
 class LayoutEdgeAttrib {
 public:
-  struct attrib_list {
-    const char *name;
+  /* # of markers per edge stored without allocation */
+  enum { LE_INLINE = 4 };
+
+  struct attrib {
+    int id;			// interned marker name
     long offset;		// this offset is relative to assuming
 				// the bottom left corner of the
 				// actual layout bounding box is (0,0).
-    struct attrib_list *next;
   };
+
+  /* the markers on one edge, sorted by offset */
+  struct attrib_list {
+    int n;			// # of markers
+    int max;			// size of ext; 0 if inl is used
+    attrib inl[LE_INLINE];
+    attrib *ext;
+
+    attrib &operator[](int i) { return ext ? ext[i] : inl[i]; }
+    const char *name (int i) { return LayoutEdgeAttrib::name ((*this)[i].id); }
+  };
+
+  /* edge index, for code that handles all four edges the same way */
+  enum { LE_LEFT = 0, LE_RIGHT = 1, LE_TOP = 2, LE_BOT = 3 };
 private:
 
   /* at the moment, we have the same attribute for the horizontal edge
      as the vertical edge
   */
-  attrib_list *_left, *_right, *_top, *_bot;
+  attrib_list _e[4];
 
-  attrib_list *dup (attrib_list *l, long adj = 0);
+  static void init (attrib_list *l) {
+    l->n = 0;
+    l->max = 0;
+    l->ext = NULL;
+  }
+  static void push (attrib_list *l, int id, long offset);
+  static void dup (attrib_list *to, attrib_list *from, long adj = 0);
 
   /*
     Merge y into x.
     Both lists have to be sorted by offset.
    */
-  bool merge (attrib_list **x, attrib_list *y);
+  static bool merge (attrib_list *x, attrib_list *y, long adj = 0);
+
+  static void freelist (attrib_list *l);
 
-  void freelist (attrib_list *l);
+  attrib_list *_edge (int e) { return &_e[e]; }
 
 public:
   LayoutEdgeAttrib() {
-    _left = NULL;
-    _right = NULL;
-    _top = NULL;
-    _bot = NULL;
+    for (int i=0; i < 4; i++) {
+      init (&_e[i]);
+    }
   }
 
   ~LayoutEdgeAttrib() {
@@ -75,32 +103,15 @@ public:
 
 
   void mkCopy (LayoutEdgeAttrib &le) {
-    clearleft ();
-    clearright ();
-    cleartop ();
-    clearbot ();
-    _left = dup (le._left);
-    _right = dup (le._right);
-    _top = dup (le._top);
-    _bot = dup (le._bot);
+    for (int i=0; i < 4; i++) {
+      dup (&_e[i], &le._e[i]);
+    }
   }
 
-  void clearleft() {
-    freelist (_left);
-    _left = NULL;
-  }
-  void clearright() {
-    freelist (_right);
-    _right = NULL;
-  }
-  void cleartop() {
-    freelist (_top);
-    _top = NULL;
-  }
-  void clearbot() {
-    freelist (_bot);
-    _bot = NULL;
-  }
+  void clearleft() { freelist (&_e[LE_LEFT]); }
+  void clearright() { freelist (&_e[LE_RIGHT]); }
+  void cleartop() { freelist (&_e[LE_TOP]); }
+  void clearbot() { freelist (&_e[LE_BOT]); }
 
   void clear () {
     clearleft();
@@ -109,60 +120,64 @@ public:
     clearbot();
   }
 
-  attrib_list *left() { return _left; }
-  attrib_list *right() { return _right; }
-  attrib_list *top() { return _top; }
-  attrib_list *bot() { return _bot; }
+  void clearedge (int e) {
+    freelist (_edge (e));
+  }
+
+  attrib_list *left() { return &_e[LE_LEFT]; }
+  attrib_list *right() { return &_e[LE_RIGHT]; }
+  attrib_list *top() { return &_e[LE_TOP]; }
+  attrib_list *bot() { return &_e[LE_BOT]; }
+  attrib_list *edge(int e) { return _edge (e); }
+
+  /* marker names <-> ids */
+  static int intern (const char *name);
+  static const char *name (int id);
+
+  /* add a single marker to edge e */
+  void add (int e, const char *name, long offset);
 
   static void print (FILE *fp, attrib_list *l);
   
   /* compute alignment between two sets of markers; returns amt that
-     should be added to l2 to get to l1's offset */
-
-  /* XXX: when we support multiple independent attributes, we will
-     need multiple shift amounts for alignment
-  */
+     should be added to l2 to get to l1's offset. Runs in time linear
+     in the number of markers unless many of them share a name. */
   static bool align (attrib_list *l1, attrib_list *l2, long *amt);
 
-  void setleft(attrib_list *x, long adj = 0) {
-    clearleft();
-    _left = dup (x, adj);
-  }
-  void setright(attrib_list *x, long adj = 0) {
-    clearright();
-    _right = dup(x, adj);
-  }
-  void settop(attrib_list *x, long adj = 0) {
-    cleartop();
-    _top = dup (x, adj);
-  }
-  void setbot(attrib_list *x, long adj = 0) {
-    clearbot();
-    _bot = dup (x, adj);
-  }
+  void setleft(attrib_list *x, long adj = 0) { dup (&_e[LE_LEFT], x, adj); }
+  void setright(attrib_list *x, long adj = 0) { dup (&_e[LE_RIGHT], x, adj); }
+  void settop(attrib_list *x, long adj = 0) { dup (&_e[LE_TOP], x, adj); }
+  void setbot(attrib_list *x, long adj = 0) { dup (&_e[LE_BOT], x, adj); }
 
   bool mergeleft(attrib_list *x, long adj = 0) {
-    return merge (&_left, dup (x, adj));
+    return merge (&_e[LE_LEFT], x, adj);
   }
   bool mergeright(attrib_list *x, long adj = 0) {
-    return merge (&_right, dup (x, adj));
+    return merge (&_e[LE_RIGHT], x, adj);
   }
   bool mergetop(attrib_list *x, long adj = 0) {
-    return merge (&_top, dup (x, adj));
+    return merge (&_e[LE_TOP], x, adj);
   }
   bool mergebot(attrib_list *x, long adj = 0) {
-    return merge (&_bot, dup (x, adj));
+    return merge (&_e[LE_BOT], x, adj);
   }
 
   void swaplr ();
   void swaptb ();
   void swap45();
 
-  attrib_list *flipsign (attrib_list *x);
-  void adjust (attrib_list *x, long adj);
+  static void flipsign (attrib_list *x);
+  static void adjust (attrib_list *x, long adj);
 
   LayoutEdgeAttrib *Clone();
   LayoutEdgeAttrib *Clone (TransformMat *m);
+
+  /*
+    Merge the attributes of src that end up on edge e once m is
+    applied into edge e. Same as merging the matching edge of
+    src->Clone(m), without building the other three edges.
+  */
+  bool mergeXform (int e, LayoutEdgeAttrib *src, TransformMat *m);
 };
 
 
@@ -27,6 +27,7 @@
 #include <act/passes/netlist.h>
 #include <act/tech.h>
 #include <common/qops.h>
+#include <mutex>
 #include "geom.h"
 
 
@@ -265,12 +266,20 @@ Layout::~Layout()
 
   t = base;
 
+  /* metal layers are linked above the base layer */
   while (t) {
     l = t;
     t = t->up;
     delete l;
   }
+  FREE (metals);
 
+  hash_bucket_t *b;
+  hash_iter_t it;
+  hash_iter_init (lmap, &it);
+  while ((b = hash_iter_next (lmap, &it))) {
+    FREE (b->v);
+  }
   hash_free (lmap);
 
   if (_rect_inpath) {
@@ -450,26 +459,52 @@ void Layout::PrintRect (FILE *fp, TransformMat *t, bool istopcell)
     }
 
     if (_le) {
-      for (l = _le->left(); l; l = l->next) {
+      l = _le->left();
+      for (int i=0; i < l->n; i++) {
         fprintf (fp, "rect $l:%s $align %ld %ld %ld %ld\n",
-	         l->name, llx, l->offset, llx, l->offset);
+	         l->name (i), llx, (*l)[i].offset, llx, (*l)[i].offset);
       }
-      for (l = _le->right(); l; l = l->next) {
+      l = _le->right();
+      for (int i=0; i < l->n; i++) {
         fprintf (fp, "rect $r:%s $align %ld %ld %ld %ld\n",
-	         l->name, urx, l->offset, urx, l->offset);
+	         l->name (i), urx, (*l)[i].offset, urx, (*l)[i].offset);
       }
-      for (l = _le->top(); l; l = l->next) {
+      l = _le->top();
+      for (int i=0; i < l->n; i++) {
         fprintf (fp, "rect $t:%s $align %ld %ld %ld %ld\n",
-	         l->name, l->offset, ury, l->offset, ury);
+	         l->name (i), (*l)[i].offset, ury, (*l)[i].offset, ury);
       }
-      for (l = _le->bot(); l; l = l->next) {
+      l = _le->bot();
+      for (int i=0; i < l->n; i++) {
         fprintf (fp, "rect $b:%s $align %ld %ld %ld %ld\n",
-	         l->name, l->offset, lly, l->offset, lly);
+	         l->name (i), (*l)[i].offset, lly, (*l)[i].offset, lly);
       }
     }
   }
 }
 
+static std::mutex _netlist_lock;
+
+void Layout::lockNetlist ()
+{
+  _netlist_lock.lock ();
+}
+
+void Layout::unlockNetlist ()
+{
+  _netlist_lock.unlock ();
+}
+
+node_t *Layout::lookupNode (netlist_t *N, const char *s)
+{
+  node_t *n;
+
+  _netlist_lock.lock ();
+  n = ActNetlistPass::string_to_node (N, (char *)s);
+  _netlist_lock.unlock ();
+  return n;
+}
+
 void Layout::markPins ()
 {
   if (!N || !N->bN) return;
@@ -477,7 +512,9 @@ void Layout::markPins ()
   for (int i=0; i < A_LEN (N->bN->ports); i++) {
     node_t *n;
     if (N->bN->ports[i].omit) continue;
+    lockNetlist ();
     n = ActNetlistPass::connection_to_node (N, N->bN->ports[i].c);
+    unlockNetlist ();
 #if 0
     printf ("%cpin: ", N->bN->ports[i].input ? 'i' : 'o');
     ActNetlistPass::emit_node (N, stdout, n, NULL, NULL, 0);
@@ -592,12 +629,12 @@ void Layout::getBloatBBox (long *llx, long *lly, long *urx, long *ury)
 /*
   Returns a list with alternating  (Layer, listoftiles)
 */
-list_t *Layout::search (void *net)
+list_t *Layout::search (void *net, const Rectangle *r)
 {
   list_t *ret = list_new ();
   list_t *tmp;
 
-  tmp = base->searchMat (net);
+  tmp = base->searchMat (net, r);
   if (list_isempty (tmp)) {
     list_free (tmp);
   }
@@ -607,7 +644,7 @@ list_t *Layout::search (void *net)
   }
   
   for (int i=0; i < nmetals; i++) {
-    list_t *l = metals[i]->searchMat (net);
+    list_t *l = metals[i]->searchMat (net, r);
     if (list_isempty (l)) {
       list_free (l);
     }
@@ -616,7 +653,7 @@ list_t *Layout::search (void *net)
       list_append (ret, l);
     }
 
-    l = metals[i]->searchVia (net);
+    l = metals[i]->searchVia (net, r);
     if (list_isempty (l)) {
       list_free (l);
     }
@@ -631,12 +668,12 @@ list_t *Layout::search (void *net)
 /*
   Returns a list with alternating  (Layer, listoftiles)
 */
-list_t *Layout::search (int type)
+list_t *Layout::search (int type, const Rectangle *r)
 {
   list_t *ret = list_new ();
   list_t *tmp;
 
-  tmp = base->searchMat (type);
+  tmp = base->searchMat (type, r);
   if (list_isempty (tmp)) {
     list_free (tmp);
   }
@@ -712,12 +749,14 @@ void Layout::propagateAllNets ()
 		    if (t->getNet() != neighbors[k]->getNet()) {
 		      //warning ("[%s] Layer::propagateNet(): Tile at (%ld,%d)\n\t connected neighbor (dir=%d) with different net", N->bN->p->getName(),
 		      //t->getllx(), t->getlly(), k);
+		      lockNetlist ();
 		      warning ("[%s] Net propagation detected two nets are shorted.", N->bN->p->getName());
 		      fprintf (stderr, "\tnet1: ");
 		      ActNetlistPass::emit_node (N, stderr, (node_t *)t->getNet(), NULL, NULL);
 		      fprintf (stderr, "; net2: ");
 		      ActNetlistPass::emit_node (N, stderr, (node_t *)neighbors[k]->getNet(), NULL, NULL);
 		      fprintf (stderr, "\n");
+		      unlockNetlist ();
 		    }
 		  }
 		  else {
@@ -794,12 +833,14 @@ void Layout::propagateAllNets ()
 	      if (propnet && propnet != up->getNet()) {
 		//warning ("[%s] Layer::propagateNet(): Tile at (%ld,%d) has connected neighbor (dir=up) with different net", N->bN->p->getName(),
 		//t->getllx(), t->getlly());
+		lockNetlist ();
 		warning ("[%s] Net propagation detected two nets are shorted across layers.", N->bN->p->getName());
 		fprintf (stderr, "\tnet1: ");
 		ActNetlistPass::emit_node (N, stderr, (node_t *)propnet, NULL, NULL);
 		fprintf (stderr, "; net2: ");
 		ActNetlistPass::emit_node (N, stderr, (node_t *)up->getNet(), NULL, NULL);
 		fprintf (stderr, "\n");
+		unlockNetlist ();
 	      }
 	      else {
 		propnet = up->getNet();
@@ -809,12 +850,14 @@ void Layout::propagateAllNets ()
 	      if (propnet && propnet != t->getNet()) {
 		//warning ("[%s] Layer::propagateNet(): Via tile at (%ld,%d) has connected neighbor with different net", N->bN->p->getName(),
 		//t->getllx(), t->getlly());
+		lockNetlist ();
 		warning ("[%s] Net propagation detected two nets are shorted.", N->bN->p->getName());
 		fprintf (stderr, "\tnet1: ");
 		ActNetlistPass::emit_node (N, stderr, (node_t *)propnet, NULL, NULL);
 		fprintf (stderr, "; net2: ");
 		ActNetlistPass::emit_node (N, stderr, (node_t *)t->getNet(), NULL, NULL);
 		fprintf (stderr, "\n");
+		unlockNetlist ();
 	      }
 	      else {
 		propnet = t->getNet();
@@ -897,14 +940,66 @@ void Layout::propagateAllNets ()
   FREE (tl);
 }
 
-list_t *Layout::searchAllMetal ()
+void Layout::appendFlat (struct flat_layout *f, int leaf,
+			 const TransformMat &m)
+{
+  Assert (f->nlayers == 1 + 2*nmetals, "Layer count mismatch");
+
+  if (!f->layers[0].l) {
+    f->layers[0].l = base;
+    for (int i=0; i < nmetals; i++) {
+      f->layers[2*i+1].l = metals[i];
+      f->layers[2*i+2].l = metals[i];
+    }
+  }
+  base->appendRects (&f->layers[0].b, NULL, 0, leaf, m);
+  for (int i=0; i < nmetals; i++) {
+    metals[i]->appendRects (&f->layers[2*i+1].b, &f->layers[2*i+2].b,
+			    2*i+1, leaf, m);
+  }
+}
+
+Rectangle Layout::searchBBox (void *net)
+{
+  Rectangle r = base->getNetBBox (net, 0);
+  for (int i=0; i < nmetals; i++) {
+    r = r ^ metals[i]->getNetBBox (net, 1);
+  }
+  return r;
+}
+
+Rectangle Layout::searchBBox (unsigned int attr)
+{
+  return base->getAttrBBox (attr);
+}
+
+void Layout::appendSearch (search_buf *buf, int what, void *net,
+			   unsigned int attr, int leaf, const TransformMat &m)
+{
+  if (what == RECT_NET) {
+    base->appendRects (buf, NULL, 0, leaf, m, RECT_NET, net);
+    for (int i=0; i < nmetals; i++) {
+      metals[i]->appendRects (buf, buf, 2*i+1, leaf, m, RECT_NET, net);
+    }
+  }
+  else if (what == RECT_ATTR) {
+    base->appendRects (buf, NULL, 0, leaf, m, RECT_ATTR, NULL, attr);
+  }
+  else {
+    for (int i=0; i < nmetals; i++) {
+      metals[i]->appendRects (buf, NULL, 2*i+1, leaf, m);
+    }
+  }
+}
+
+list_t *Layout::searchAllMetal (const Rectangle *r)
 {
   list_t *ret = list_new ();
   Layer *L;
   listitem_t *li;
 
   for (int i=0; i < nmetals; i++) {
-    list_t *l = metals[i]->allNonSpaceMat ();
+    list_t *l = metals[i]->allNonSpaceMat (r);
     if (list_isempty (l)) {
       list_free (l);
     }
@@ -1045,6 +1140,46 @@ void TransformMat::apply (long inx, long iny, long *outx, long *outy) const
   }
 }
 
+void TransformMat::applyInv (long inx, long iny, long *outx, long *outy) const
+{
+  inx -= _dx;
+  iny -= _dy;
+  if (_swap) {
+    *outx = (_flipx ? -iny : iny);
+    *outy = (_flipy ? -inx : inx);
+  }
+  else {
+    *outx = (_flipx ? -inx : inx);
+    *outy = (_flipy ? -iny : iny);
+  }
+}
+
+Rectangle TransformMat::applyInvBox (const Rectangle &r) const
+{
+  long llx, lly, urx, ury;
+  Rectangle ret;
+
+  if (r.empty()) {
+    return ret;
+  }
+
+  applyInv (r.llx(), r.lly(), &llx, &lly);
+  applyInv (r.urx(), r.ury(), &urx, &ury);
+
+  if (llx > urx) {
+    long tmp = llx;
+    llx = urx;
+    urx = tmp;
+  }
+  if (lly > ury) {
+    long tmp = lly;
+    lly = ury;
+    ury = tmp;
+  }
+  ret.setRect (llx, lly, urx - llx + 1, ury - lly + 1);
+  return ret;
+}
+
 void TransformMat::applyMat (const TransformMat &t)
 {
   if (t._swap) {
@@ -1086,6 +1221,58 @@ Rectangle TransformMat::applyBox (const Rectangle &r) const
   return ret;
 }
 
+/*
+  The orientation is fixed for a batch, so each of the eight cases
+  gets its own loop with the corners picked at compile time.
+*/
+template<int swap, int flipx, int flipy>
+static void _xform_rects (const struct flat_rect *in, struct flat_rect *out,
+			  size_t n, long dx, long dy)
+{
+  for (size_t i=0; i < n; i++) {
+    long llx = in[i].llx;
+    long lly = in[i].lly;
+    long urx = in[i].urx;
+    long ury = in[i].ury;
+
+    if (in != out) {
+      out[i] = in[i];
+    }
+    if (swap) {
+      out[i].llx = (flipy ? -ury : lly) + dx;
+      out[i].urx = (flipy ? -lly : ury) + dx;
+      out[i].lly = (flipx ? -urx : llx) + dy;
+      out[i].ury = (flipx ? -llx : urx) + dy;
+    }
+    else {
+      out[i].llx = (flipx ? -urx : llx) + dx;
+      out[i].urx = (flipx ? -llx : urx) + dx;
+      out[i].lly = (flipy ? -ury : lly) + dy;
+      out[i].ury = (flipy ? -lly : ury) + dy;
+    }
+  }
+}
+
+void TransformMat::applyRects (const struct flat_rect *in,
+			       struct flat_rect *out, size_t n) const
+{
+  switch ((_swap << 2) | (_flipx << 1) | _flipy) {
+  case 0:
+    if (in == out && _dx == 0 && _dy == 0) {
+      return;
+    }
+    _xform_rects<0,0,0> (in, out, n, _dx, _dy);
+    break;
+  case 1: _xform_rects<0,0,1> (in, out, n, _dx, _dy); break;
+  case 2: _xform_rects<0,1,0> (in, out, n, _dx, _dy); break;
+  case 3: _xform_rects<0,1,1> (in, out, n, _dx, _dy); break;
+  case 4: _xform_rects<1,0,0> (in, out, n, _dx, _dy); break;
+  case 5: _xform_rects<1,0,1> (in, out, n, _dx, _dy); break;
+  case 6: _xform_rects<1,1,0> (in, out, n, _dx, _dy); break;
+  case 7: _xform_rects<1,1,1> (in, out, n, _dx, _dy); break;
+  }
+}
+
 void TransformMat::Print (FILE *fp) const
 {
   fprintf (fp, "{");
@@ -1119,7 +1306,7 @@ void TransformMat::PrintRect (FILE *fp) const
 }
 
 
-void TransformMat::_set_orientation (char *buf)
+void TransformMat::_set_orientation (const char *buf)
 {
   if (strcmp (buf, "N") == 0) {
     // nothing
@@ -1172,6 +1359,17 @@ TransformMat TransformMat::ReadRect (FILE *fp)
 }
 
 
+TransformMat TransformMat::ReadRect (const char *orient, long dx, long dy)
+{
+  TransformMat m;
+
+  m._dx = dx;
+  m._dy = dy;
+  m._set_orientation (orient);
+  return m;
+}
+
+
 TransformMat TransformMat::ReadRect (char *buf, int *amt)
 {
   TransformMat m;
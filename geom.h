@@ -28,18 +28,22 @@
 #include <common/path.h>
 #include "tile.h"
 #include "attrib.h"
+#include <atomic>
+#include <unordered_set>
 
 
 /*
  * Geometry transformation matrix
  */
+struct flat_rect;
+
 class TransformMat {
   long _dx, _dy;
   unsigned int _flipx:1;
   unsigned int _flipy:1;
   unsigned int _swap:1;
 
-  void _set_orientation (char *buf);
+  void _set_orientation (const char *buf);
 public:
   TransformMat ();
 
@@ -54,6 +58,15 @@ public:
 
   Rectangle applyBox (const Rectangle &r) const;
 
+  // transform n rectangles, normalizing the corners; in and out can
+  // be the same array
+  void applyRects (const struct flat_rect *in, struct flat_rect *out,
+		   size_t n) const;
+
+  // inverse transformation
+  void applyInv (long inx, long iny, long *outx, long *outy) const;
+  Rectangle applyInvBox (const Rectangle &r) const;
+
   void applyMat (const TransformMat &t);
 
   void Print (FILE *fp) const;
@@ -65,9 +78,19 @@ public:
   // reads transform matrix and returns the # of characters processed
   // in amt
   static TransformMat ReadRect (char *buf, int *amt);
+
+  // transform matrix from already tokenized orientation and offset
+  static TransformMat ReadRect (const char *orient, long dx, long dy);
 };
 
 
+struct search_buf;
+
+/* tile filters for Layer::appendRects() */
+#define RECT_ALL  0		// all non-space tiles
+#define RECT_NET  1		// tiles on a net
+#define RECT_ATTR 2		// tiles with an attribute
+
 /*
  * One abstract layer
  */
@@ -95,6 +118,19 @@ protected:
      This bloats the bounding box by ceil(minimum spacing/2) on all sides.
   */
 
+  /* extents of the material tiles, by attribute. These grow as
+     paint is drawn, and are recomputed if tile attributes change */
+  struct attr_extent {
+    unsigned int attr;
+    Rectangle r;
+  };
+  A_DECL (struct attr_extent, _attrbox);
+  unsigned int _attrbox_valid:1; // 1 if _attrbox is up to date
+  void _growAttrBox (unsigned int attr, const Rectangle &r);
+
+  static void _searchwindow (Tile *t, const Rectangle *r, void *cookie,
+			     void (*fn) (void *, Tile *));
+
  public:
   Layer (Material *, netlist_t *);
   ~Layer ();
@@ -115,18 +151,33 @@ protected:
 
   void markPins (void *net, int isinput); // mark pin tiles
   
-  list_t *searchMat (void *net);
-  list_t *searchMat (int attr);
-  list_t *searchVia (void *net);
-  list_t *searchVia (int attr);
-  list_t *allNonSpaceMat ();
-  list_t *allNonSpaceVia ();	// looks at "up" vias only
+  /* if r is specified, only tiles that overlap r are returned */
+  list_t *searchMat (void *net, const Rectangle *r = NULL);
+  list_t *searchMat (int attr, const Rectangle *r = NULL);
+  list_t *searchVia (void *net, const Rectangle *r = NULL);
+  list_t *searchVia (int attr, const Rectangle *r = NULL);
+  list_t *allNonSpaceMat (const Rectangle *r = NULL);
+  list_t *allNonSpaceVia (const Rectangle *r = NULL); // looks at "up" vias only
 
   void getBBox (long *llx, long *lly, long *urx, long *ury);
   void getBloatBBox (long *llx, long *lly, long *urx, long *ury);
 
+  /* bounding box of the material tiles with attribute attr */
+  Rectangle getAttrBBox (unsigned int attr);
+
+  /* bounding box of the material (and "up" via, if via is set)
+     tiles on net */
+  Rectangle getNetBBox (void *net, int via);
+
   void PrintRect (FILE *fp, TransformMat *t = NULL);
 
+  /* append the tiles that pass the filter, transformed by m, to bmat
+     (and the "up" vias to bvia, if non-NULL). slot is the layer
+     index recorded for material tiles; vias use slot+1. */
+  void appendRects (search_buf *bmat, search_buf *bvia, int slot,
+		    int leaf, const TransformMat &m, int what = RECT_ALL,
+		    void *net = NULL, unsigned int attr = 0);
+
   const char *getRouteName() {
     RoutingMat *rmat = dynamic_cast<RoutingMat *> (mat);
     if (rmat) {
@@ -184,6 +235,14 @@ public:
 
   void markPins ();
 
+  /*
+    Netlist lookups are not reentrant. These serialize access to the
+    netlist so that several .rect files can be read concurrently.
+  */
+  static node_t *lookupNode (netlist_t *N, const char *s);
+  static void lockNetlist ();
+  static void unlockNetlist ();
+
   
   PolyMat *getPoly ();
   FetMat *getFet (int type, int flavor = 0); // type == EDGE_NFET or EDGE_PFET
@@ -197,9 +256,20 @@ public:
 
   void PrintRect (FILE *fp, TransformMat *t = NULL, bool istopcell=true);
 
-  list_t *search (void *net);
-  list_t *search (int attr);
-  list_t *searchAllMetal ();
+  list_t *search (void *net, const Rectangle *r = NULL);
+  list_t *search (int attr, const Rectangle *r = NULL);
+  list_t *searchAllMetal (const Rectangle *r = NULL);
+
+  void appendFlat (struct flat_layout *f, int leaf, const TransformMat &m);
+
+  /* bounding box of the tiles returned by search (net/attr) */
+  Rectangle searchBBox (void *net);
+  Rectangle searchBBox (unsigned int attr);
+
+  /* buffer versions of search (RECT_NET), search (RECT_ATTR), and
+     searchAllMetal (RECT_ALL) */
+  void appendSearch (search_buf *buf, int what, void *net, unsigned int attr,
+		     int leaf, const TransformMat &m);
 
   void propagateAllNets();
 
@@ -267,6 +337,8 @@ struct blob_list {
 				// the first blob and the bounding
 				// box/etc.
 
+  blob_compose c;		// how it was appended
+
   struct blob_list *next;
 };
 
@@ -277,6 +349,45 @@ struct tile_listentry {
 };
 
 
+/*
+ * A transformed tile. layer is the layer slot: 0 = base, 2i+1 =
+ * metal i+1, 2i+2 = vias from metal i+1 to the next layer up. leaf
+ * is the index of the BLOB_BASE it came from, in search order.
+ */
+struct flat_rect {
+  long llx, lly, urx, ury;	// transformed tile, inclusive
+  void *net;
+  unsigned int attr;
+  int layer;
+  int leaf;
+  unsigned int virt:1;		// virtual tile
+  unsigned int fet:1;		// Tile::isFet()
+  unsigned int diff:1;		// Tile::isDiff()
+};
+
+/*
+ * Search results, in search order. The buffer is owned by the
+ * caller and can be reused across searches.
+ */
+struct search_buf {
+  A_DECL (struct flat_rect, r);
+};
+
+/*
+ * Flattened geometry of a LayoutBlob: one buffer per layer slot.
+ */
+struct flat_layer {
+  Layer *l;			// layer from the first leaf, if any
+  search_buf b;
+};
+
+struct flat_layout {
+  int nleaves;
+  int nlayers;
+  struct flat_layer *layers;
+};
+
+
 class LayoutBlob {
 private:
   union {
@@ -302,11 +413,52 @@ private:
 
   LayoutEdgeAttrib *_le;
 
+  /* list blobs: the children on each edge of the abutment box, in
+     the order they were appended. The edges of _le are built from
+     them on demand, so appending does not touch _le. */
+  struct edge_src {
+    A_DECL (blob_list *, b);
+    int done;			// # of entries already merged into _le
+  } *_edges;
+  void _edgeAdd (int e, blob_list *bl, bool replace);
+  void _edgeClear ();
+  void _edgeResolve (int e);
+  void _edgeDrop (blob_list *bl);
+  void _edgeMerge (blob_list *bl, const Rectangle &old_box);
+  void _refreshBoxes (std::unordered_set<LayoutBlob *> *done);
+
   unsigned long count;		// for statistics tracking
 
   bool readRect;
 
+  std::atomic<int> _refs;	// reference count; see incRef()
+
+  flat_layout *_flat;		// flattened geometry, if any
+  unsigned long _flat_gen;	// _treeGen() when _flat was built
+
+  /* generation stamps: _gen is set from the global counter whenever
+     this blob itself changes, so the largest stamp in a subtree
+     changes iff something in it did */
+  unsigned long _gen;
+  static std::atomic<unsigned long> _gen_stamp;
+  void _touch () { _gen = ++_gen_stamp; }
+  unsigned long _treeGen (std::unordered_set<LayoutBlob *> *seen);
+  void _flatten (flat_layout *f, TransformMat *m);
+  void _searchBuf (int what, void *net, unsigned int attr,
+		   search_buf *buf, int *leaf, TransformMat *m);
+  void _searchBBox (int what, void *net, unsigned int attr,
+		    Rectangle *acc, TransformMat *m);
+
   void _printRect (FILE *fp, TransformMat *t, bool istopcell = true);
+
+  /* shared search: what = 0 (net), 1 (type), 2 (all metal) */
+  list_t *_search (int what, void *net, int type, const Rectangle *r,
+		   TransformMat *m);
+
+  static void _readRectDraw (Layout *L, netlist_t *nl,
+			     Hashtable *nets, int *hits, const char *net,
+			     const char *material,
+			     long llx, long lly, long urx, long ury);
   
 public:
   LayoutBlob (blob_type type, Layout *l = NULL);
@@ -326,6 +478,12 @@ public:
   void appendBlob (LayoutBlob *b, blob_compose c, long gap = 0, bool flip = false);
 
   void markRead () { readRect = true; }
+
+  /**
+   * Exchange the contents of this blob with b. Used to update a blob
+   * in place, so that existing references to it see the new layout.
+   */
+  void replaceWith (LayoutBlob *b);
   bool getRead() { return readRect; }
   
   void PrintRect (FILE *fp, TransformMat *t = NULL, bool istopcell = true);
@@ -363,6 +521,15 @@ public:
 						     // base layers
   list_t *searchAllMetal (TransformMat *m = NULL);
 
+  /**
+   * Region-restricted search. Only tiles that overlap r are returned;
+   * r is in the coordinates of the caller (i.e. after m is applied).
+   * Sub-blobs whose bounding box is outside r are skipped.
+   */
+  list_t *search (void *net, const Rectangle &r, TransformMat *m = NULL);
+  list_t *search (int type, const Rectangle &r, TransformMat *m = NULL);
+  list_t *searchAllMetal (const Rectangle &r, TransformMat *m = NULL);
+
   /* 
    * Uses the return value from the search function and returns its
    * bounding box
@@ -371,6 +538,37 @@ public:
 			  long *bury);
   static void searchFree (list_t *tiles);
 
+  /**
+   * Search into a caller-provided buffer instead of a list. Previous
+   * contents of the buffer are discarded. Returns the number of
+   * rectangles found; they are already transformed by m.
+   */
+  int search (void *net, search_buf *buf, TransformMat *m = NULL);
+  int search (int type, search_buf *buf, TransformMat *m = NULL);
+  int searchAllMetal (search_buf *buf, TransformMat *m = NULL);
+
+  /**
+   * Bounding box of the tiles that search (type/net, m) would
+   * return, computed without collecting the tiles. Empty if there
+   * are none.
+   */
+  Rectangle searchBBox (int type, TransformMat *m = NULL);
+  Rectangle searchBBox (void *net, TransformMat *m = NULL);
+
+  static void searchInit (search_buf *buf);
+  static void searchBBox (const search_buf *buf, long *bllx, long *blly,
+			  long *burx, long *bury);
+  static void searchFree (search_buf *buf);
+
+  /**
+   * Flattened geometry in the coordinates of this blob, built on
+   * first use. It is rebuilt if any blob has been modified since;
+   * changes to a Layout after it is wrapped in a blob are not
+   * tracked.
+   */
+  const flat_layout *flatten ();
+  void flattenFree ();
+
   /**
    * Get abutment box
    */
@@ -379,7 +577,12 @@ public:
   /**
    * Get edge attributes!
    */
-  LayoutEdgeAttrib *getLayoutEdgeAttrib() { return _le; }
+  LayoutEdgeAttrib *getLayoutEdgeAttrib() {
+    for (int i=0; i < 4; i++) {
+      _edgeResolve (i);
+    }
+    return _le;
+  }
 
   /**
    * Stats 
@@ -391,18 +594,22 @@ public:
    * Alignment markers
    */
   LayoutEdgeAttrib::attrib_list *getLeftAlign() {
+    _edgeResolve (LayoutEdgeAttrib::LE_LEFT);
     return _le->left();
   }
   
   LayoutEdgeAttrib::attrib_list *getRightAlign() {
+    _edgeResolve (LayoutEdgeAttrib::LE_RIGHT);
     return _le->right();
   }
   
   LayoutEdgeAttrib::attrib_list *getTopAlign() {
+    _edgeResolve (LayoutEdgeAttrib::LE_TOP);
     return _le->top();
   }
   
   LayoutEdgeAttrib::attrib_list *getBotAlign() {
+    _edgeResolve (LayoutEdgeAttrib::LE_BOT);
     return _le->bot();
   }
 
@@ -410,6 +617,7 @@ public:
    * Print alignment markers
    */
   void printAlign (FILE *fp) {
+    getLayoutEdgeAttrib ();
     fprintf (fp, "l: ");
     LayoutEdgeAttrib::print (fp, _le->left());
     fprintf (fp, "; r: ");
@@ -428,17 +636,82 @@ public:
    *   mode = 4 : 2 + warning on bbox change
    *   mode = 5 : 3 + warning on bbox change
    *
+   *   cell lines become subcell instances that share the geometry
+   *   of their cell type. The type is looked up with
+   *   findOrClaimCell(), and if it is not registered it is read from
+   *   <type>.rect in the same directory as the file.
+   *
+   *   cache = 1 : use the binary .rectb form of the file if it is
+   *               up to date, and write it otherwise. It is kept
+   *               next to the file, or in cachedir if specified.
+   *
    * Returns the bbox as well
    */
   static LayoutBlob *ReadRect (const char *file, netlist_t *nl,
-			       Rectangle& bbox, int mode = 1);
+			       Rectangle& bbox, int mode = 1,
+			       int cache = 0, const char *cachedir = NULL);
+
+  /**
+   * Content hash of a .rect file. Returns false if the file can't be
+   * read.
+   */
+  static bool RectHash (const char *file, unsigned long *hash);
+
+  /**
+   * Where ReadRect reports what it is doing in the verbose modes;
+   * stdout unless set (e.g. when stdout carries the DEF output)
+   */
+  static FILE *_rect_info;
+  static FILE *rectInfo () { return _rect_info ? _rect_info : stdout; }
+  static void setRectInfo (FILE *fp) { _rect_info = fp; }
 
   //static LayoutBlob *ReadRect (Process *p, netlist_t *nl, int mode = 1);
 
   /**
-   * Map from Process * to a LayoutBlob
+   * Map from cell type name (the .rect file name without the suffix)
+   * to its LayoutBlob. Subcell instances in .rect files share the
+   * registered blob for their type.
    */
   static Hashtable *procToBlob;
+  static void registerCell (const char *name, LayoutBlob *b);
+  static LayoutBlob *findCell (const char *name);
+
+  /**
+   * Atomic lookup-or-load: returns the registered cell, or NULL if
+   * the caller now owns loading it and must follow up with
+   * registerCell() or abandonCell(). Threads asking for a cell that
+   * is being loaded wait for it; waits that would form a cycle
+   * between loading threads are a fatal error.
+   */
+  static LayoutBlob *findOrClaimCell (const char *name);
+  static void abandonCell (const char *name);
+
+  /**
+   * Cells read in by cell lines from their own .rect file, rather
+   * than through a process: cell name to file name.
+   */
+  static Hashtable *cellToFile;
+  static void setCellFile (const char *name, const char *file);
+
+  /**
+   * Recompute the cached boxes and edge attributes of all registered
+   * cells and everything they contain, after cells were updated in
+   * place. The placement of the blobs in a list is kept.
+   */
+  static void refreshCells ();
+  static void clearCells ();	// drop all registered cells
+
+  /**
+   * Ownership. A blob is created with one reference, held by its
+   * creator. A list blob holds a reference to each blob in it (and
+   * owns its blob_list nodes), a base blob owns its Layout, a cell
+   * blob owns its SubcellInst, a SubcellInst holds a reference to
+   * the cell it instantiates, and the cell registry holds a
+   * reference to each registered cell. decRef() deletes the blob
+   * once the last reference is dropped.
+   */
+  void incRef () { _refs++; }
+  static void decRef (LayoutBlob *b);
 
   friend class SubcellInst;
 };
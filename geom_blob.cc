@@ -21,7 +21,17 @@
  */
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
 #include <common/list.h>
+#include <common/hash.h>
 #include <act/act.h>
 #include <act/passes.h>
 #include <act/passes/netlist.h>
@@ -40,12 +50,270 @@
 
 
 Hashtable *LayoutBlob::procToBlob = NULL;
+std::atomic<unsigned long> LayoutBlob::_gen_stamp (0);
+static std::mutex _cell_lock;
+
+/* cells being loaded, claimed with findOrClaimCell(); the value
+   identifies the loading thread */
+static Hashtable *_cell_loading = NULL;
+static std::condition_variable _cell_loaded;
+static thread_local int _cell_self;
+
+/* loading thread to the name of the cell it is waiting for */
+static struct pHashtable *_cell_waits = NULL;
+
+/* drop the claim on name, if any; called with _cell_lock held */
+static void _cell_unclaim (const char *name)
+{
+  if (_cell_loading && hash_lookup (_cell_loading, name)) {
+    hash_delete (_cell_loading, name);
+    _cell_loaded.notify_all ();
+  }
+}
+
+void LayoutBlob::registerCell (const char *name, LayoutBlob *b)
+{
+  hash_bucket_t *hb;
+  LayoutBlob *old = NULL;
+
+  _cell_lock.lock ();
+  if (!procToBlob) {
+    procToBlob = hash_new (16);
+  }
+  hb = hash_lookup (procToBlob, name);
+  if (!hb) {
+    hb = hash_add (procToBlob, name);
+    hb->v = NULL;
+  }
+  if (hb->v != b) {
+    old = (LayoutBlob *) hb->v;
+    b->incRef ();
+    hb->v = b;
+  }
+  _cell_unclaim (name);
+  _cell_lock.unlock ();
+
+  if (old) {
+    decRef (old);
+  }
+}
+
+Hashtable *LayoutBlob::cellToFile = NULL;
+FILE *LayoutBlob::_rect_info = NULL;
+
+void LayoutBlob::setCellFile (const char *name, const char *file)
+{
+  hash_bucket_t *hb;
+
+  _cell_lock.lock ();
+  if (!cellToFile) {
+    cellToFile = hash_new (4);
+  }
+  hb = hash_lookup (cellToFile, name);
+  if (hb) {
+    FREE (hb->v);
+    if (!file) {
+      hash_delete (cellToFile, name);
+    }
+  }
+  else if (file) {
+    hb = hash_add (cellToFile, name);
+  }
+  if (file) {
+    hb->v = Strdup (file);
+  }
+  _cell_lock.unlock ();
+}
+
+void LayoutBlob::refreshCells ()
+{
+  std::unordered_set<LayoutBlob *> done;
+  hash_bucket_t *hb;
+  hash_iter_t it;
+
+  if (!procToBlob) {
+    return;
+  }
+  hash_iter_init (procToBlob, &it);
+  while ((hb = hash_iter_next (procToBlob, &it))) {
+    ((LayoutBlob *) hb->v)->_refreshBoxes (&done);
+  }
+}
+
+/*
+ * Recompute the boxes and edges of this blob from its children,
+ * children first. A list is replayed the way appendBlob() built it,
+ * using the transformations it computed then.
+ */
+void LayoutBlob::_refreshBoxes (std::unordered_set<LayoutBlob *> *done)
+{
+    if(done->find (this) != done->end()) {
+        return;
+    }
+    done->insert (this);
+
+    if(t == BLOB_CELL) {
+        LayoutEdgeAttrib *le;
+        subcell->getBlob()->_refreshBoxes (done);
+        _bbox = subcell->getBBox ();
+        _bloatbbox = subcell->getBloatBBox ();
+        _abutbox = subcell->getAbutBox ();
+        le = subcell->getLayoutEdgeAttrib ();
+        delete _le;
+        _le = le ? le : new LayoutEdgeAttrib();
+    }
+    else if(t == BLOB_LIST) {
+        for(blob_list *bl = l.hd; bl; q_step (bl)) {
+            bl->b->_refreshBoxes (done);
+        }
+        _edgeClear ();
+        for(blob_list *bl = l.hd; bl; q_step (bl)) {
+            LayoutBlob *b = bl->b;
+            if(bl == l.hd) {
+                _bbox = bl->T.applyBox (b->getBBox());
+                _bloatbbox = bl->T.applyBox (b->getBloatBBox());
+                _abutbox = bl->T.applyBox (b->getAbutBox());
+                for(int i=0; i < 4; i++) {
+                    _edgeAdd (i, bl, true);
+                }
+                continue;
+            }
+            _bbox = _bbox ^ bl->T.applyBox (b->getBBox());
+            _bloatbbox = _bloatbbox ^ bl->T.applyBox (b->getBloatBBox());
+            if(!b->getAbutBox().empty() && !_abutbox.empty()) {
+                Rectangle old_box = _abutbox;
+                _abutbox = _abutbox ^ bl->T.applyBox (b->getAbutBox());
+                _edgeMerge (bl, old_box);
+            }
+            else if(bl->c != BLOB_MERGE) {
+                _abutbox.clear ();
+                _edgeClear ();
+            }
+        }
+    }
+}
+
+void LayoutBlob::clearCells ()
+{
+  Hashtable *H;
+
+  _cell_lock.lock ();
+  H = procToBlob;
+  procToBlob = NULL;
+  if (cellToFile) {
+    hash_bucket_t *hb;
+    hash_iter_t it;
+    hash_iter_init (cellToFile, &it);
+    while ((hb = hash_iter_next (cellToFile, &it))) {
+      FREE (hb->v);
+    }
+    hash_free (cellToFile);
+    cellToFile = NULL;
+  }
+  _cell_lock.unlock ();
+
+  if (!H) {
+    return;
+  }
+
+  hash_bucket_t *hb;
+  hash_iter_t it;
+  hash_iter_init (H, &it);
+  while ((hb = hash_iter_next (H, &it))) {
+    decRef ((LayoutBlob *) hb->v);
+  }
+  hash_free (H);
+}
+
+void LayoutBlob::decRef (LayoutBlob *b)
+{
+  if (b && --b->_refs == 0) {
+    delete b;
+  }
+}
+
+LayoutBlob *LayoutBlob::findCell (const char *name)
+{
+  hash_bucket_t *hb;
+  LayoutBlob *b = NULL;
+
+  _cell_lock.lock ();
+  if (procToBlob && (hb = hash_lookup (procToBlob, name))) {
+    b = (LayoutBlob *) hb->v;
+  }
+  _cell_lock.unlock ();
+  return b;
+}
+
+LayoutBlob *LayoutBlob::findOrClaimCell (const char *name)
+{
+  std::unique_lock<std::mutex> g(_cell_lock);
+  hash_bucket_t *hb;
+
+  while (1) {
+    if (procToBlob && (hb = hash_lookup (procToBlob, name))) {
+      return (LayoutBlob *) hb->v;
+    }
+    if (!_cell_loading) {
+      _cell_loading = hash_new (4);
+    }
+    hb = hash_lookup (_cell_loading, name);
+    if (!hb) {
+      hb = hash_add (_cell_loading, name);
+      hb->v = &_cell_self;
+      return NULL;
+    }
+    if (hb->v == &_cell_self) {
+      /* we are loading it: a cell that contains itself */
+      return NULL;
+    }
+
+    /* follow the chain of loaders: if the thread loading name is
+       (transitively) waiting on a cell we are loading, nobody will
+       ever finish */
+    void *owner = hb->v;
+    phash_bucket_t *pb;
+    if (!_cell_waits) {
+      _cell_waits = phash_new (4);
+    }
+    while ((pb = phash_lookup (_cell_waits, owner))) {
+      hash_bucket_t *ob = hash_lookup (_cell_loading, (char *) pb->v);
+      if (!ob) {
+	break;
+      }
+      owner = ob->v;
+      if (owner == &_cell_self) {
+	fatal_error ("Cell `%s' includes `%s' and vice versa; recursive cell?",
+		     (char *) pb->v, name);
+      }
+    }
+
+    pb = phash_add (_cell_waits, &_cell_self);
+    pb->v = (void *) name;
+    _cell_loaded.wait (g);
+    phash_delete (_cell_waits, &_cell_self);
+  }
+}
+
+void LayoutBlob::abandonCell (const char *name)
+{
+  _cell_lock.lock ();
+  _cell_unclaim (name);
+  _cell_lock.unlock ();
+}
 
 LayoutBlob::LayoutBlob (ExternMacro *m)
 {
     long llx, lly, urx, ury;
     t = BLOB_MACRO;
     macro = m;
+    readRect = false;
+    count = 0;
+    _refs = 1;
+    _flat = NULL;
+    _flat_gen = 0;
+    _touch ();
+    _edges = NULL;
     if(macro && macro->isValid()) {
         macro->getBBox (&llx, &lly, &urx, &ury);
         _bbox.setRectCoords (llx, lly, urx, ury);
@@ -68,6 +336,11 @@ LayoutBlob::LayoutBlob (blob_type type, Layout *lptr)
     readRect = false;
 
     count = 0;
+    _refs = 1;
+    _flat = NULL;
+    _flat_gen = 0;
+    _touch ();
+    _edges = NULL;
 
     switch(t) {
     case BLOB_MACRO:
@@ -101,23 +374,31 @@ LayoutBlob::LayoutBlob (blob_type type, Layout *lptr)
     case BLOB_LIST:
         l.hd = NULL;
         l.tl = NULL;
+        MALLOC (_edges, edge_src, 4);
+        for(int i=0; i < 4; i++) {
+            A_INIT (_edges[i].b);
+            _edges[i].done = 0;
+        }
+        _le = new LayoutEdgeAttrib();
         if(lptr) {
             blob_list *bl;
             NEW (bl, blob_list);
             bl->b = new LayoutBlob (BLOB_BASE, lptr);
+            bl->c = BLOB_MERGE;
             bl->next = NULL;
             bl->T.mkI();
             q_ins (l.hd, l.tl, bl);
             _bbox = bl->b->_bbox;
             _bloatbbox = bl->b->_bloatbbox;
             _abutbox = bl->b->_abutbox;
-            _le = bl->b->_le->Clone();
+            for(int i=0; i < 4; i++) {
+                _edgeAdd (i, bl, true);
+            }
         }
         else {
             _bbox.clear ();
             _bloatbbox.clear ();
             _abutbox.clear ();
-            _le = new LayoutEdgeAttrib();
         }
         break;
     }
@@ -130,6 +411,11 @@ LayoutBlob::LayoutBlob (SubcellInst *cell)
 
     readRect = false;
     count = 0;
+    _refs = 1;
+    _flat = NULL;
+    _flat_gen = 0;
+    _touch ();
+    _edges = NULL;
 
     Assert (cell, "What?");
 
@@ -261,10 +547,13 @@ void LayoutBlob::appendBlob (LayoutBlob *b, blob_compose c, long gap, bool flip)
 
     Assert (t == BLOB_LIST, "What?");
 
+    _touch ();
+
     blob_list *bl;
     NEW (bl, blob_list);
     bl->next = NULL;
     bl->b = b;
+    bl->c = c;
     bl->T.mkI();
 
     q_ins (l.hd, l.tl, bl);
@@ -286,7 +575,9 @@ void LayoutBlob::appendBlob (LayoutBlob *b, blob_compose c, long gap, bool flip)
 	}
 	bl->T.translate (0, gap);
       }
-      _le = bl->b->getLayoutEdgeAttrib()->Clone (&(bl->T));
+      for (int i=0; i < 4; i++) {
+	_edgeAdd (i, bl, true);
+      }
       _bbox = bl->T.applyBox (_bbox);
       _bloatbbox = bl->T.applyBox (_bloatbbox);
 
@@ -321,15 +612,15 @@ void LayoutBlob::appendBlob (LayoutBlob *b, blob_compose c, long gap, bool flip)
 	  bl->T.mirrorLR();
 	}
 
-	LayoutEdgeAttrib *tmpEdgeAttr =
-	  bl->b->getLayoutEdgeAttrib()->Clone (&(bl->T));
+	LayoutEdgeAttrib tmpEdgeAttr;
+	tmpEdgeAttr.mergeXform (LayoutEdgeAttrib::LE_LEFT,
+				bl->b->getLayoutEdgeAttrib(), &(bl->T));
 
-	valid = LayoutEdgeAttrib::align (_le->right(), tmpEdgeAttr->left(), &damt);
+	valid = LayoutEdgeAttrib::align (getRightAlign(), tmpEdgeAttr.left(), &damt);
 	if (!valid) {
 	  warning ("appendBlob: no valid alignment, but continuing anyway");
 	  damt = 0;
 	}
-	delete tmpEdgeAttr;
 
 	Rectangle bx_bbox, bx_abutbox, bx_bloatbbox;
 	bx_bbox = bl->T.applyBox (b->getBBox());
@@ -389,7 +680,7 @@ void LayoutBlob::appendBlob (LayoutBlob *b, blob_compose c, long gap, bool flip)
 	}
 	else {
 	  _abutbox.clear();
-	  _le = new LayoutEdgeAttrib();
+	  _edgeClear ();
 	}
       }
       else if (c == BLOB_VERT) {
@@ -402,16 +693,16 @@ void LayoutBlob::appendBlob (LayoutBlob *b, blob_compose c, long gap, bool flip)
 	  bl->T.mirrorTB();
 	}
 
-	LayoutEdgeAttrib *tmpEdgeAttr =
-	  bl->b->getLayoutEdgeAttrib()->Clone(&(bl->T));
+	LayoutEdgeAttrib tmpEdgeAttr;
+	tmpEdgeAttr.mergeXform (LayoutEdgeAttrib::LE_BOT,
+				bl->b->getLayoutEdgeAttrib(), &(bl->T));
 
-	valid = LayoutEdgeAttrib::align (_le->top(), tmpEdgeAttr->bot(), &damt);
+	valid = LayoutEdgeAttrib::align (getTopAlign(), tmpEdgeAttr.bot(), &damt);
 
 	if (!valid) {
 	  warning ("appendBlob: no valid alignment, but continuing anyway");
 	  damt = 0;
 	}
-	delete tmpEdgeAttr;
 
 	Rectangle bx_bbox, bx_abutbox, bx_bloatbbox;
 	bx_bbox = bl->T.applyBox (b->getBBox());
@@ -475,7 +766,7 @@ void LayoutBlob::appendBlob (LayoutBlob *b, blob_compose c, long gap, bool flip)
 	}
 	else {
 	  _abutbox.clear();
-	  _le = new LayoutEdgeAttrib();
+	  _edgeClear ();
 	}
       }
       else if (c == BLOB_MERGE) {
@@ -494,64 +785,8 @@ void LayoutBlob::appendBlob (LayoutBlob *b, blob_compose c, long gap, bool flip)
 	fatal_error ("What?");
       }
 
-      /* now merge attributes if we used abutment */
       if (do_merge_attrib) {
-	//get the already transformed edge attributes
-	LayoutEdgeAttrib *tmpEdgeAttr =
-	  bl->b->getLayoutEdgeAttrib()->Clone(&(bl->T));
-
-	Rectangle r = bl->T.applyBox (b->getAbutBox());
-
-	if(r.llx() == _abutbox.llx()) {
-	  if(old_box.llx() == r.llx()) {
-	    // merge!
-	    //_le->mergeleft (tmpEdgeAttr->left(), merge_y);
-	    _le->mergeleft (tmpEdgeAttr->left());
-
-	  }
-	  else {
-	    // shift left aligh by damt
-	    //_le->setleft (tmpEdgeAttr->left(), merge_y);
-	    _le->setleft (tmpEdgeAttr->left());
-	  }
-	}
-	if(r.urx() == _abutbox.urx()) {
-	  if(old_box.urx() == r.urx()) {
-	    // merge!
-	    //_le->mergeright (tmpEdgeAttr->right(), merge_y);
-	    _le->mergeright (tmpEdgeAttr->right());
-	  }
-	  else {
-	    // shift left aligh by damt
-	    //_le->setright (tmpEdgeAttr->right(), merge_y);
-	    _le->setright (tmpEdgeAttr->right());
-	  }
-	}
-	if(r.lly() == _abutbox.lly()) {
-	  if(old_box.lly() == r.lly()) {
-	    // merge!
-	    //_le->mergebot (tmpEdgeAttr->bot(), merge_x);
-	    _le->mergebot (tmpEdgeAttr->bot());
-	  }
-	  else {
-	    // shift left aligh by damt
-	    //_le->setbot (tmpEdgeAttr->bot(), merge_x);
-	    _le->setbot (tmpEdgeAttr->bot());
-	  }
-	}
-	if(r.ury() == _abutbox.ury()) {
-	  if(old_box.ury() == r.ury()) {
-	    // merge!
-	    //_le->mergetop (tmpEdgeAttr->top(), merge_x);
-	    _le->mergetop (tmpEdgeAttr->top());
-	  }
-	  else {
-	    // shift left aligh by damt
-	    //_le->settop (tmpEdgeAttr->top(), merge_x);
-	    _le->settop (tmpEdgeAttr->top());
-	  }
-	}
-	delete tmpEdgeAttr;
+	_edgeMerge (bl, old_box);
       }
     }
 #if 0
@@ -562,6 +797,101 @@ void LayoutBlob::appendBlob (LayoutBlob *b, blob_compose c, long gap, bool flip)
 }
 
 
+/*
+ * Merge attributes when abutment was used: an edge of the new blob bl
+ * that is on the boundary replaces the old edge, or is merged with
+ * it if the old edge (from old_box) is still on the boundary too.
+ * The attributes themselves are only computed when needed.
+ */
+void LayoutBlob::_edgeMerge (blob_list *bl, const Rectangle &old_box)
+{
+    Rectangle r = bl->T.applyBox (bl->b->getAbutBox());
+
+    if(r.llx() == _abutbox.llx()) {
+        _edgeAdd (LayoutEdgeAttrib::LE_LEFT, bl, old_box.llx() != r.llx());
+    }
+    if(r.urx() == _abutbox.urx()) {
+        _edgeAdd (LayoutEdgeAttrib::LE_RIGHT, bl, old_box.urx() != r.urx());
+    }
+    if(r.lly() == _abutbox.lly()) {
+        _edgeAdd (LayoutEdgeAttrib::LE_BOT, bl, old_box.lly() != r.lly());
+    }
+    if(r.ury() == _abutbox.ury()) {
+        _edgeAdd (LayoutEdgeAttrib::LE_TOP, bl, old_box.ury() != r.ury());
+    }
+}
+
+void LayoutBlob::_edgeAdd (int e, blob_list *bl, bool replace)
+{
+    edge_src *es = &_edges[e];
+    if(replace) {
+        A_LEN (es->b) = 0;
+        es->done = 0;
+        _le->clearedge (e);
+    }
+    A_NEW (es->b, blob_list *);
+    A_NEXT (es->b) = bl;
+    A_INC (es->b);
+}
+
+void LayoutBlob::_edgeClear ()
+{
+    for(int i=0; i < 4; i++) {
+        A_LEN (_edges[i].b) = 0;
+        _edges[i].done = 0;
+    }
+    _le->clear ();
+}
+
+/*
+ * Merge the children added to edge e since the last call into _le.
+ * Registered cells are shared between the threads that read .rect
+ * files, so this is serialized.
+ */
+static std::recursive_mutex _edge_lock;
+
+void LayoutBlob::_edgeResolve (int e)
+{
+    if(!_edges) {
+        return;
+    }
+    _edge_lock.lock ();
+    edge_src *es = &_edges[e];
+    while(es->done < A_LEN (es->b)) {
+        blob_list *bl = es->b[es->done];
+        _le->mergeXform (e, bl->b->getLayoutEdgeAttrib(), &(bl->T));
+        es->done++;
+    }
+    _edge_lock.unlock ();
+}
+
+/*
+ * Forget a child that is about to be freed. Its contribution is kept
+ * if it was already merged into _le.
+ */
+void LayoutBlob::_edgeDrop (blob_list *bl)
+{
+    if(!_edges) {
+        return;
+    }
+    for(int e=0; e < 4; e++) {
+        edge_src *es = &_edges[e];
+        int j = 0;
+        for(int i=0; i < A_LEN (es->b); i++) {
+            if(es->b[i] == bl) {
+                if(i < es->done) {
+                    es->done--;
+                }
+            }
+            else {
+                es->b[j++] = es->b[i];
+            }
+        }
+        A_LEN (es->b) = j;
+    }
+}
+
+
 void LayoutBlob::_printRect (FILE *fp, TransformMat *mat, bool istopcell)
 {
   switch(t) {
@@ -644,22 +974,26 @@ void LayoutBlob::PrintRect (FILE *fp, TransformMat *mat, bool istopcell)
 	      ury = _abutbox.ury() + 1;
             }
 
-            if(_le) {
-	      for(l = _le->left(); l; l = l->next) {
+            if(getLayoutEdgeAttrib()) {
+	      l = _le->left();
+	      for(int i=0; i < l->n; i++) {
 		fprintf (fp, "rect $l:%s $align %ld %ld %ld %ld\n",
-			 l->name, llx, l->offset, llx, l->offset);
+			 l->name (i), llx, (*l)[i].offset, llx, (*l)[i].offset);
 	      }
-	      for(l = _le->right(); l; l = l->next) {
+	      l = _le->right();
+	      for(int i=0; i < l->n; i++) {
 		fprintf (fp, "rect $r:%s $align %ld %ld %ld %ld\n",
-			 l->name, urx, l->offset, urx, l->offset);
+			 l->name (i), urx, (*l)[i].offset, urx, (*l)[i].offset);
 	      }
-	      for(l = _le->top(); l; l = l->next) {
+	      l = _le->top();
+	      for(int i=0; i < l->n; i++) {
 		fprintf (fp, "rect $t:%s $align %ld %ld %ld %ld\n",
-			 l->name, l->offset, ury, l->offset, ury);
+			 l->name (i), (*l)[i].offset, ury, (*l)[i].offset, ury);
 	      }
-	      for(l = _le->bot(); l; l = l->next) {
+	      l = _le->bot();
+	      for(int i=0; i < l->n; i++) {
 		fprintf (fp, "rect $b:%s $align %ld %ld %ld %ld\n",
-			 l->name, l->offset, lly, l->offset, lly);
+			 l->name (i), (*l)[i].offset, lly, (*l)[i].offset, lly);
 	      }
             }
         }
@@ -674,6 +1008,42 @@ void LayoutBlob::PrintRect (FILE *fp, TransformMat *mat, bool istopcell)
 
 
 list_t *LayoutBlob::search (void *net, TransformMat *m)
+{
+  return _search (0, net, 0, NULL, m);
+}
+
+list_t *LayoutBlob::search (int type, TransformMat *m)
+{
+  return _search (1, NULL, type, NULL, m);
+}
+
+list_t *LayoutBlob::searchAllMetal (TransformMat *m)
+{
+  return _search (2, NULL, 0, NULL, m);
+}
+
+list_t *LayoutBlob::search (void *net, const Rectangle &r, TransformMat *m)
+{
+  return _search (0, net, 0, &r, m);
+}
+
+list_t *LayoutBlob::search (int type, const Rectangle &r, TransformMat *m)
+{
+  return _search (1, NULL, type, &r, m);
+}
+
+list_t *LayoutBlob::searchAllMetal (const Rectangle &r, TransformMat *m)
+{
+  return _search (2, NULL, 0, &r, m);
+}
+
+/*
+  r, if specified, is the search window in the coordinate frame
+  after m is applied. It is mapped back into each blob's own frame
+  through the inverse of the current transformation.
+*/
+list_t *LayoutBlob::_search (int what, void *net, int type,
+			     const Rectangle *r, TransformMat *m)
 {
     TransformMat tmat;
     list_t *tiles;
@@ -683,7 +1053,22 @@ list_t *LayoutBlob::search (void *net, TransformMat *m)
     }
     if(t == BLOB_BASE) {
         if(base.l) {
-            tiles = base.l->search (net);
+            Rectangle win;
+            if(r) {
+                win = tmat.applyInvBox (*r);
+                if(!win.overlaps (_bbox)) {
+                    return list_new ();
+                }
+            }
+            if(what == 0) {
+                tiles = base.l->search (net, r ? &win : NULL);
+            }
+            else if(what == 1) {
+                tiles = base.l->search (type, r ? &win : NULL);
+            }
+            else {
+                tiles = base.l->searchAllMetal (r ? &win : NULL);
+            }
             if(list_isempty (tiles)) {
                 return tiles;
             }
@@ -714,12 +1099,37 @@ list_t *LayoutBlob::search (void *net, TransformMat *m)
                 tmat.mkI();
             }
             tmat.applyMat (bl->T);
-            list_t *tmp = bl->b->search (net, &tmat);
+            if(r && !tmat.applyInvBox (*r).overlaps (bl->b->getBBox())) {
+                continue;
+            }
+            list_t *tmp = bl->b->_search (what, net, type, r, &tmat);
             list_concat (tiles, tmp);
             list_free (tmp);
         }
     }
-    else if(t == BLOB_MACRO) {
+    else if(t == BLOB_CELL) {
+        LayoutBlob *cb = subcell->getBlob();
+        tiles = list_new ();
+
+        int ilo = 0, ihi = subcell->getNX() - 1;
+        int jlo = 0, jhi = subcell->getNY() - 1;
+        if(r) {
+            // only visit the array elements that overlap the window
+            Rectangle w = m ? m->applyInvBox (*r) : *r;
+            if(!subcell->getElemRange (w, &ilo, &ihi, &jlo, &jhi)) {
+                return tiles;
+            }
+        }
+        for(int i=ilo; i <= ihi; i++) {
+            for(int j=jlo; j <= jhi; j++) {
+                subcell->getElemMat (i, j, &tmat, m);
+                list_t *tmp = cb->_search (what, net, type, r, &tmat);
+                list_concat (tiles, tmp);
+                list_free (tmp);
+            }
+        }
+    }
+    else if(t == BLOB_MACRO && what != 2) {
       /* nothing, macro */
         tiles = list_new ();
     }
@@ -730,39 +1140,128 @@ list_t *LayoutBlob::search (void *net, TransformMat *m)
     return tiles;
 }
 
-list_t *LayoutBlob::search (int type, TransformMat *m)
+/*
+  Collect the tiles of all leaves, using the same traversal and
+  transformations as search()
+*/
+void LayoutBlob::_flatten (flat_layout *f, TransformMat *m)
 {
     TransformMat tmat;
-    list_t *tiles;
 
     if(m) {
         tmat = *m;
     }
     if(t == BLOB_BASE) {
         if(base.l) {
-            tiles = base.l->search (type);
-            if(list_isempty (tiles)) {
-                return tiles;
+            base.l->appendFlat (f, f->nleaves, tmat);
+            f->nleaves++;
+        }
+    }
+    else if(t == BLOB_LIST) {
+        blob_list *bl;
+        for(bl = l.hd; bl; q_step (bl)) {
+            if(m) {
+                tmat = *m;
             }
             else {
-                struct tile_listentry *tle;
-                NEW (tle, struct tile_listentry);
-                tle->m = tmat;
-                tle->tiles = tiles;
-                tiles = list_new ();
-                list_append (tiles, tle);
-                return tiles;
+                tmat.mkI();
             }
+            tmat.applyMat (bl->T);
+            bl->b->_flatten (f, &tmat);
         }
-        else {
-            tiles = list_new ();
-            return tiles;
+    }
+    else if(t == BLOB_CELL) {
+        for(int i=0; i < subcell->getNX(); i++) {
+            for(int j=0; j < subcell->getNY(); j++) {
+                subcell->getElemMat (i, j, &tmat, m);
+                subcell->getBlob()->_flatten (f, &tmat);
+            }
+        }
+    }
+}
+
+/*
+ * The largest generation stamp of any blob in this subtree
+ */
+unsigned long LayoutBlob::_treeGen (std::unordered_set<LayoutBlob *> *seen)
+{
+    unsigned long g = _gen;
+    unsigned long x;
+
+    if(seen->find (this) != seen->end()) {
+        return 0;
+    }
+    seen->insert (this);
+
+    if(t == BLOB_LIST) {
+        for(blob_list *bl = l.hd; bl; q_step (bl)) {
+            x = bl->b->_treeGen (seen);
+            if(x > g) {
+                g = x;
+            }
+        }
+    }
+    else if(t == BLOB_CELL) {
+        x = subcell->getBlob()->_treeGen (seen);
+        if(x > g) {
+            g = x;
+        }
+    }
+    return g;
+}
+
+const flat_layout *LayoutBlob::flatten ()
+{
+    std::unordered_set<LayoutBlob *> seen;
+    unsigned long gen = _treeGen (&seen);
+
+    if(_flat && _flat_gen == gen) {
+        return _flat;
+    }
+    flattenFree ();
+
+    _flat_gen = gen;
+    NEW (_flat, flat_layout);
+    _flat->nleaves = 0;
+    _flat->nlayers = 1 + 2*Technology::T->nmetals;
+    MALLOC (_flat->layers, flat_layer, _flat->nlayers);
+    for(int i=0; i < _flat->nlayers; i++) {
+        _flat->layers[i].l = NULL;
+        searchInit (&_flat->layers[i].b);
+    }
+    _flatten (_flat, NULL);
+    return _flat;
+}
+
+void LayoutBlob::flattenFree ()
+{
+    if(!_flat) {
+        return;
+    }
+    for(int i=0; i < _flat->nlayers; i++) {
+        searchFree (&_flat->layers[i].b);
+    }
+    FREE (_flat->layers);
+    FREE (_flat);
+    _flat = NULL;
+}
+
+void LayoutBlob::_searchBuf (int what, void *net, unsigned int attr,
+			     search_buf *buf, int *leaf, TransformMat *m)
+{
+    TransformMat tmat;
+
+    if(m) {
+        tmat = *m;
+    }
+    if(t == BLOB_BASE) {
+        if(base.l) {
+            base.l->appendSearch (buf, what, net, attr, *leaf, tmat);
+            (*leaf)++;
         }
     }
     else if(t == BLOB_LIST) {
         blob_list *bl;
-        tiles = list_new ();
-
         for(bl = l.hd; bl; q_step (bl)) {
             if(m) {
                 tmat = *m;
@@ -771,25 +1270,175 @@ list_t *LayoutBlob::search (int type, TransformMat *m)
                 tmat.mkI();
             }
             tmat.applyMat (bl->T);
-            list_t *tmp = bl->b->search (type, &tmat);
-            list_concat (tiles, tmp);
-            list_free (tmp);
+            bl->b->_searchBuf (what, net, attr, buf, leaf, &tmat);
         }
     }
-    else if(t == BLOB_MACRO) {
-        tiles = list_new ();
+    else if(t == BLOB_CELL) {
+        for(int i=0; i < subcell->getNX(); i++) {
+            for(int j=0; j < subcell->getNY(); j++) {
+                subcell->getElemMat (i, j, &tmat, m);
+                subcell->getBlob()->_searchBuf (what, net, attr, buf, leaf,
+                                                &tmat);
+            }
+        }
+    }
+    else if(t == BLOB_MACRO && what != RECT_ALL) {
+      /* nothing, macro */
     }
     else {
-        tiles = NULL;
         fatal_error ("New blob?");
     }
-    return tiles;
 }
 
+int LayoutBlob::search (void *net, search_buf *buf, TransformMat *m)
+{
+    int leaf = 0;
+    A_LEN (buf->r) = 0;
+    _searchBuf (RECT_NET, net, 0, buf, &leaf, m);
+    return A_LEN (buf->r);
+}
 
-LayoutBlob::~LayoutBlob ()
+int LayoutBlob::search (int type, search_buf *buf, TransformMat *m)
 {
-  /* XXX do something here! */
+    int leaf = 0;
+    A_LEN (buf->r) = 0;
+    _searchBuf (RECT_ATTR, NULL, type, buf, &leaf, m);
+    return A_LEN (buf->r);
+}
+
+int LayoutBlob::searchAllMetal (search_buf *buf, TransformMat *m)
+{
+    int leaf = 0;
+    A_LEN (buf->r) = 0;
+    _searchBuf (RECT_ALL, NULL, 0, buf, &leaf, m);
+    return A_LEN (buf->r);
+}
+
+void LayoutBlob::_searchBBox (int what, void *net, unsigned int attr,
+			      Rectangle *acc, TransformMat *m)
+{
+    TransformMat tmat;
+
+    if(m) {
+        tmat = *m;
+    }
+    if(t == BLOB_BASE) {
+        if(base.l) {
+            Rectangle r;
+            if(what == RECT_NET) {
+                r = base.l->searchBBox (net);
+            }
+            else {
+                r = base.l->searchBBox (attr);
+            }
+            if(!r.empty()) {
+                *acc = *acc ^ tmat.applyBox (r);
+            }
+        }
+    }
+    else if(t == BLOB_LIST) {
+        blob_list *bl;
+        for(bl = l.hd; bl; q_step (bl)) {
+            if(m) {
+                tmat = *m;
+            }
+            else {
+                tmat.mkI();
+            }
+            tmat.applyMat (bl->T);
+            bl->b->_searchBBox (what, net, attr, acc, &tmat);
+        }
+    }
+    else if(t == BLOB_CELL) {
+        for(int i=0; i < subcell->getNX(); i++) {
+            for(int j=0; j < subcell->getNY(); j++) {
+                subcell->getElemMat (i, j, &tmat, m);
+                subcell->getBlob()->_searchBBox (what, net, attr, acc, &tmat);
+            }
+        }
+    }
+}
+
+Rectangle LayoutBlob::searchBBox (int type, TransformMat *m)
+{
+    Rectangle r;
+    _searchBBox (RECT_ATTR, NULL, type, &r, m);
+    return r;
+}
+
+Rectangle LayoutBlob::searchBBox (void *net, TransformMat *m)
+{
+    Rectangle r;
+    _searchBBox (RECT_NET, net, 0, &r, m);
+    return r;
+}
+
+void LayoutBlob::searchInit (search_buf *buf)
+{
+    A_INIT (buf->r);
+}
+
+void LayoutBlob::searchBBox (const search_buf *buf, long *bllx, long *blly,
+                             long *burx, long *bury)
+{
+    if(A_LEN (buf->r) == 0) {
+        *bllx = 0;
+        *blly = 0;
+        *burx = -1;
+        *bury = -1;
+        return;
+    }
+    *bllx = buf->r[0].llx;
+    *blly = buf->r[0].lly;
+    *burx = buf->r[0].urx;
+    *bury = buf->r[0].ury;
+    for(int i=1; i < A_LEN (buf->r); i++) {
+        *bllx = MIN(*bllx, buf->r[i].llx);
+        *blly = MIN(*blly, buf->r[i].lly);
+        *burx = MAX(*burx, buf->r[i].urx);
+        *bury = MAX(*bury, buf->r[i].ury);
+    }
+    (*burx)++;
+    (*bury)++;
+}
+
+void LayoutBlob::searchFree (search_buf *buf)
+{
+    A_FREE (buf->r);
+    A_INIT (buf->r);
+}
+
+LayoutBlob::~LayoutBlob ()
+{
+    flattenFree ();
+    if(t == BLOB_BASE) {
+        if(base.l) {
+            delete base.l;
+        }
+    }
+    else if(t == BLOB_LIST) {
+        blob_list *bl;
+        while(l.hd) {
+            bl = l.hd;
+            l.hd = bl->next;
+            decRef (bl->b);
+            FREE (bl);
+        }
+        l.tl = NULL;
+    }
+    else if(t == BLOB_CELL) {
+        delete subcell;
+    }
+    /* macros belong to the netlist */
+    if(_le) {
+        delete _le;
+    }
+    if(_edges) {
+        for(int i=0; i < 4; i++) {
+            A_FREE (_edges[i].b);
+        }
+        FREE (_edges);
+    }
 }
 
 
@@ -891,7 +1540,7 @@ void LayoutBlob::searchFree (list_t *slist)
 LayoutBlob *LayoutBlob::delBBox (LayoutBlob *b)
 {
     if(!b) return NULL;
-    if(b->t == BLOB_MACRO) {
+    if(b->t == BLOB_MACRO || b->t == BLOB_CELL) {
         return b;
     }
     if(b->t == BLOB_BASE) {
@@ -899,18 +1548,28 @@ LayoutBlob *LayoutBlob::delBBox (LayoutBlob *b)
             return b;
         }
         else {
-            delete b;
+            decRef (b);
             return NULL;
         }
     }
     else {
         blob_list *x, *prev;
+
+        /* merge the edges while all the children are still around;
+           the old attributes included the deleted children as well */
+        if(b->_edges) {
+            for(int e=0; e < 4; e++) {
+                b->_edgeResolve (e);
+            }
+        }
         prev = NULL;
         x = b->l.hd;
         while(x) {
             x->b = LayoutBlob::delBBox (x->b);
             if(!x->b) {
                 q_delete_item (b->l.hd, b->l.tl, prev, x);
+                b->_edgeDrop (x);
+                b->_touch ();
                 FREE (x);
                 if(prev) {
                     x = prev->next;
@@ -925,7 +1584,7 @@ LayoutBlob *LayoutBlob::delBBox (LayoutBlob *b)
             }
         }
         if(!b->l.hd) {
-            delete b;
+            decRef (b);
             return NULL;
         }
         else {
@@ -934,59 +1593,26 @@ LayoutBlob *LayoutBlob::delBBox (LayoutBlob *b)
     }
 }
 
-list_t *LayoutBlob::searchAllMetal (TransformMat *m)
-{
-    TransformMat tmat;
-    list_t *tiles;
 
-    if(m) {
-        tmat = *m;
-    }
-    if(t == BLOB_BASE) {
-        if(base.l) {
-            tiles = base.l->searchAllMetal();
-            if(list_isempty (tiles)) {
-                return tiles;
-            }
-            else {
-                struct tile_listentry *tle;
-                NEW (tle, struct tile_listentry);
-                tle->m = tmat;
-                tle->tiles = tiles;
-                tiles = list_new ();
-                list_append (tiles, tle);
-                return tiles;
-            }
-        }
-        else {
-            tiles = list_new ();
-            return tiles;
-        }
-    }
-    else if(t == BLOB_LIST) {
-        blob_list *bl;
-        tiles = list_new ();
 
-        for(bl = l.hd; bl; q_step (bl)) {
-            if(m) {
-                tmat = *m;
-            }
-            else {
-                tmat.mkI();
-            }
-            tmat.applyMat (bl->T);
-            list_t *tmp = bl->b->searchAllMetal (&tmat);
-            list_concat (tiles, tmp);
-            list_free (tmp);
-        }
-    }
-    else {
-        tiles = NULL;
-        fatal_error ("New blob?");
-    }
-    return tiles;
-}
 
+void LayoutBlob::replaceWith (LayoutBlob *b)
+{
+  _touch ();
+  b->_touch ();
+  std::swap (t, b->t);
+  /* l is the largest member of the union */
+  std::swap (l, b->l);
+  std::swap (_bbox, b->_bbox);
+  std::swap (_bloatbbox, b->_bloatbbox);
+  std::swap (_abutbox, b->_abutbox);
+  std::swap (_le, b->_le);
+  std::swap (_edges, b->_edges);
+  std::swap (count, b->count);
+  std::swap (readRect, b->readRect);
+  std::swap (_flat, b->_flat);
+  std::swap (_flat_gen, b->_flat_gen);
+}
 
 
 Rectangle LayoutBlob::getAbutBox()
@@ -1013,347 +1639,1175 @@ Rectangle LayoutBlob::getAbutBox()
 }
 
 
-LayoutBlob *LayoutBlob::ReadRect (const char *file, netlist_t *nl,
-				  Rectangle& bbox, int mode)
-{
-  LayoutBlob *ret;
-  FILE *fp;
-  char buf[10240];
-  int rtype = 0;
-  int offset;
-  char *net;
-  Process *p;
-  Layout *L;
+/*
+ * .rect files are mapped into memory and tokenized in place. A token
+ * is a pointer into the file plus a length; nothing is copied except
+ * short strings (materials, net names) that have to be passed to
+ * routines that need NUL-terminated strings.
+ */
+struct rect_tok {
+  const char *s;
+  int len;
+};
 
-  bbox.clear ();
+static bool _tok_eq (const rect_tok &t, const char *s)
+{
+  int i;
+  for (i=0; i < t.len; i++) {
+    if (s[i] != t.s[i]) return false;
+  }
+  return s[i] == '\0';
+}
 
-  /* the process */
-  if (nl) {
-    p = nl->bN->p;
-    Assert (p->isExpanded(), "What?");
+/* next whitespace-separated token in [*pos, end) */
+static bool _rect_token (const char **pos, const char *end, rect_tok *t)
+{
+  const char *s = *pos;
+  while (s < end && isspace ((unsigned char)*s)) {
+    s++;
   }
-  else {
-    p = NULL;
+  if (s == end) {
+    *pos = s;
+    return false;
   }
-
-  fp = fopen (file, "r");
-  if (!fp) {
-    return NULL;
+  t->s = s;
+  while (s < end && !isspace ((unsigned char)*s)) {
+    s++;
   }
+  t->len = s - t->s;
+  *pos = s;
+  return true;
+}
 
-  if (mode == 3 || mode == 5) {
-    printf ("INFO: read rect: %s\n", file);
-  }
+/* next token as an integer */
+static bool _rect_long (const char **pos, const char *end, long *v)
+{
+  rect_tok t;
+  const char *s, *e;
+  int neg = 0;
+  long x = 0;
 
-  L = new Layout (nl);
-  L->_readrect = true;
-  L->_rbox.clear ();
-  
-  while (fgets (buf, 10240, fp)) {
-#if 0
-    printf ("BUF: %s", buf);
-#endif    
-    offset = 0;
-    for (int bx=0; bx < 10240 && buf[bx]; bx++) {
-      if (!isspace (buf[bx])) { break; }
-      offset++;
-    }
-    if (buf[offset] == '\0') continue;
-    if (buf[offset] == '#') continue;
-    if (strncmp (buf+offset, "inrect ", 7) == 0) {
-      offset += 7;
-      rtype = 1;
-    }
-    else if (strncmp (buf+offset, "outrect ", 8) == 0) {
-      offset += 8;
-      rtype = 2;
-    }
-    else if (strncmp (buf+offset, "rect ", 5) == 0) {
-      offset += 5;
-      rtype = 0;
-    }
-    else if (strncmp (buf+offset, "bbox ", 5) == 0) {
-      long rlx, rly, rux, ruy;
-      sscanf (buf+5, "%ld %ld %ld %ld", &rlx, &rly, &rux, &ruy);
-      // this is auto-generated, so ignore it.
-      bbox.setRect (rlx, rly, rux - rlx, ruy - rly);
-      continue;
-    }
-    else if (strncmp (buf+offset, "sbox ", 5) == 0) {
-      // this overrides the bbox definition, so keep it
-      long rlx, rly, rux, ruy;
-      sscanf (buf+5, "%ld %ld %ld %ld", &rlx, &rly, &rux, &ruy);
-      L->_rbox.setRect (rlx, rly, rux - rlx, ruy - rly);
-      continue;
-    }
-    else if (strncmp (buf+offset, "cell ", 5) == 0) {
-      char inst[10240], celltype[10240];
-      /* celltype id orientation dx dy [arr nx px ny py] */
-      offset += 5;
-      if (sscanf (buf+offset, "%s %s", celltype, inst) != 2) {
-	fatal_error ("Line: %s\ncell spec error", buf);
-      }
-      for (int skip=0; skip < 2; skip++) {
-	while (buf[offset] && isspace (buf[offset])) {
-	  offset++;
-	}
-	while (buf[offset] && !isspace (buf[offset])) {
-	  offset++;
-	}
-      }
-      int skipamt = 0;
-      TransformMat mat = TransformMat::ReadRect (buf+offset, &skipamt);
-      offset += skipamt;
-      int nx, px, ny, py;
-      if (sscanf (buf+offset, "arr %d %d %d %d", &nx, &px, &ny, &py) == 4) {
-	// ok we have parsed the subcell instance!
-      }
-      else {
-	while (buf[offset]) {
-	  if (!isspace (buf[offset])) {
-	    fatal_error ("Line %s\ncell spec error", buf);
-	  }
-	  offset++;
-	}
-	nx = 1;
-	ny = 1;
-	px = 0;
-	py = 0;
-      }
-      // at this point we don't have any geometry for this subcell;
-      // but we should have already read in this one, so let's look it up
-      Assert (0, "Process subcell instance!");
-      continue;
-    }
-    else {
-      fatal_error ("Line: %s\nNeeds inrect, outrect, rect, bbox, sbox, or cell", buf);
+  if (!_rect_token (pos, end, &t)) {
+    return false;
+  }
+  s = t.s;
+  e = t.s + t.len;
+  if (*s == '-' || *s == '+') {
+    neg = (*s == '-');
+    s++;
+  }
+  if (s == e) {
+    return false;
+  }
+  while (s < e) {
+    if (*s < '0' || *s > '9') {
+      return false;
     }
+    x = x*10 + (*s - '0');
+    s++;
+  }
+  *v = neg ? -x : x;
+  return true;
+}
 
-    if (strncmp (buf+offset, "# ", 2) == 0) {
-      net = NULL;
-      offset += 2;
-    }
-    else {
-      net = buf+offset;
-      while (buf[offset] && buf[offset] != ' ') {
-	offset++;
-      }
-      Assert (buf[offset], "Long line");
-      buf[offset] = '\0';
-      offset++;
-    }
+/* copy token into buf (grown as needed), NUL-terminated */
+static char *_tok_str (const rect_tok &t, char **buf, int *sz)
+{
+  if (t.len + 1 > *sz) {
+    *sz = t.len + 1024;
+    REALLOC (*buf, char, *sz);
+  }
+  memcpy (*buf, t.s, t.len);
+  (*buf)[t.len] = '\0';
+  return *buf;
+}
 
-    node_t *n = NULL;
+static char *_tok_dup (const rect_tok &t, int skip)
+{
+  char *ret;
+  MALLOC (ret, char, t.len - skip + 1);
+  memcpy (ret, t.s + skip, t.len - skip);
+  ret[t.len - skip] = '\0';
+  return ret;
+}
 
-    char *material;
-    material = buf+offset;
+/*
+ * Draw one rectangle from a .rect file. net is NULL if the rectangle
+ * is unlabeled. Net names are resolved once per file; nets maps each
+ * name to its node (NULL if not found), and *hits counts the lookups
+ * that were satisfied from it.
+ */
+void LayoutBlob::_readRectDraw (Layout *L, netlist_t *nl,
+				Hashtable *nets, int *hits, const char *net,
+				const char *material,
+				long rllx, long rlly, long rurx, long rury)
+{
+  node_t *n = NULL;
 
-    while (buf[offset] && buf[offset] != ' ') {
-      offset++;
+  if (net && nl && (strcmp (material, "$align") != 0)) {
+    hash_bucket_t *b = hash_lookup (nets, net);
+    if (b) {
+      n = (node_t *) b->v;
+      (*hits)++;
     }
-    Assert (buf[offset], "Long line");
-    buf[offset] = '\0';
-    offset++;
-
-    if (net && nl && (strcmp (material, "$align") != 0)) {
-      n = ActNetlistPass::string_to_node (nl, net);
+    else {
+      n = Layout::lookupNode (nl, net);
       if (!n) {
 	warning ("Could not find signal `%s' in netlist!", net);
       }
-      //printf ("signal %s [node 0x%lx]\n", net, (unsigned long)n);
+      b = hash_add (nets, net);
+      b->v = n;
     }
-
-    long rllx, rlly, rurx, rury;
-    sscanf (buf+offset, "%ld %ld %ld %ld", &rllx, &rlly, &rurx, &rury);
+    //printf ("signal %s [node 0x%lx]\n", net, (unsigned long)n);
+  }
 
 #if 0
-    printf ("[%s] rtype=%d, net=%s, (%ld, %ld) -> (%ld, %ld)\n", material,
-	    rtype, net ? net : "-none-", rllx, rlly, rurx, rury);
+  printf ("[%s] net=%s, (%ld, %ld) -> (%ld, %ld)\n", material,
+	  net ? net : "-none-", rllx, rlly, rurx, rury);
 #endif
 
-    if ((rllx >= rurx || rlly >= rury) && !( strcmp (material, "$align") == 0 && (rllx == rurx || rlly == rury))) {
-      warning ("[%s] Empty rectangle (%ld,%ld) -> (%ld,%ld); skipped",
-	       material, rllx, rlly, rurx, rury);
-      continue;
-    }
+  if ((rllx >= rurx || rlly >= rury) && !( strcmp (material, "$align") == 0 && (rllx == rurx || rlly == rury))) {
+    warning ("[%s] Empty rectangle (%ld,%ld) -> (%ld,%ld); skipped",
+	     material, rllx, rlly, rurx, rury);
+    return;
+  }
 
-    /* now find the material/layer, and draw it */
-    if (material[0] == 'm' && isdigit(material[1])) {
-      /* m# is a metal layer */
-      int l;
-      sscanf (material+1, "%d", &l);
+  /* now find the material/layer, and draw it */
+  if (material[0] == 'm' && isdigit(material[1])) {
+    /* m# is a metal layer */
+    int l = 0;
+    for (int k=1; isdigit (material[k]); k++) {
+      l = l*10 + (material[k] - '0');
+    }
 #if 0
-      printf ("metal %d\n", l);
+    printf ("metal %d\n", l);
 #endif
 
-      if (l < 1 || l > Technology::T->nmetals) {
-	warning ("Technology has %d metal layers; found `%s'; skipped",
-		 Technology::T->nmetals, material);
-      }
-      else {
-	/*--- draw metal ---*/
-	l--;
-	if (!L->DrawMetal (l, rllx, rlly, rurx - rllx, rury - rlly, n)) {
-	  warning ("Skipped rect: metal%d @ (%ld,%ld) -> (%ld,%ld)",
-		   l+1, rllx, rlly, rurx, rury);
-	}
+    if (l < 1 || l > Technology::T->nmetals) {
+      warning ("Technology has %d metal layers; found `%s'; skipped",
+	       Technology::T->nmetals, material);
+    }
+    else {
+      /*--- draw metal ---*/
+      l--;
+      if (!L->DrawMetal (l, rllx, rlly, rurx - rllx, rury - rlly, n)) {
+	warning ("Skipped rect: metal%d @ (%ld,%ld) -> (%ld,%ld)",
+		 l+1, rllx, rlly, rurx, rury);
       }
     }
-    else if (strcmp (material, L->base->mat->getName()) == 0) {
-      /* poly */
+  }
+  else if (strcmp (material, L->base->mat->getName()) == 0) {
+    /* poly */
 #if 0
-      printf ("poly\n");
+    printf ("poly\n");
 #endif
-      /*--- draw poly ---*/
-      if (!L->DrawPoly (rllx, rlly, rurx - rllx, rury - rlly, n)) {
-	warning ("Skipped rect: poly @ (%ld,%ld) -> (%ld,%ld)",
-		 rllx, rlly, rurx, rury);
-      }
+    /*--- draw poly ---*/
+    if (!L->DrawPoly (rllx, rlly, rurx - rllx, rury - rlly, n)) {
+      warning ("Skipped rect: poly @ (%ld,%ld) -> (%ld,%ld)",
+	       rllx, rlly, rurx, rury);
+    }
+  }
+  else if (strcmp (material, "$align") == 0) {
+    /* alignment information! */
+    if (!net) {
+      /* abutbox */
+      L->_abutbox.setRect (rllx, rlly, rurx - rllx, rury - rlly);
+#if 0
+printf("new abutbox: (%ld,%ld) -> (%ld,%ld)\n",rllx, rlly, rurx, rury);
+#endif	
     }
-    else if (strcmp (material, "$align") == 0) {
-      LayoutEdgeAttrib::attrib_list *l;
-      NEW (l, LayoutEdgeAttrib::attrib_list);
-      l->next = NULL;
-      /* alignment information! */
-      if (!net) {
-	/* abutbox */
-	L->_abutbox.setRect (rllx, rlly, rurx - rllx, rury - rlly);
-  #if 0
-  printf("new abutbox: (%ld,%ld) -> (%ld,%ld)\n",rllx, rlly, rurx, rury);
-  #endif	
+    else if (strncmp (net, "$l:", 3) == 0) {
+#if 0
+printf("new marker %s left: %ld\n", net+3, rlly);
+#endif
+      if (!L->_le) {
+	L->_le = new LayoutEdgeAttrib();
       }
-      else if (strncmp (net, "$l:", 3) == 0) {
-	      l->name = Strdup (net+3);
-        #if 1
-        printf("new marker %s left: %ld\n",l->name, rlly);
-        #endif	
-	      l->offset = rlly; // left alignment: lower left corner y coord
-	      if (!L->_le) {
-	        L->_le = new LayoutEdgeAttrib();
-	      }
-	      L->_le->mergeleft (l);
+      // left alignment: lower left corner y coord
+      L->_le->add (LayoutEdgeAttrib::LE_LEFT, net+3, rlly);
+    }
+    else if (strncmp (net, "$r:", 3) == 0) {
+#if 0
+printf("new marker %s right: %ld\n", net+3, rlly);
+#endif	
+      if (!L->_le) {
+	L->_le = new LayoutEdgeAttrib();
       }
-      else if (strncmp (net, "$r:", 3) == 0) {
-        
-	l->name = Strdup (net+3);
-  #if 0
-  printf("new marker %s right: %ld\n",l->name, rlly);
-  #endif	
-	l->offset = rlly; // right alignment: lower left corner y coord
-	if (!L->_le) {
-	  L->_le = new LayoutEdgeAttrib();
-	}
-	L->_le->mergeright (l);
+      // right alignment: lower left corner y coord
+      L->_le->add (LayoutEdgeAttrib::LE_RIGHT, net+3, rlly);
+    }
+    else if (strncmp (net, "$t:", 3) == 0) {
+#if 0
+printf("new marker %s top: %ld\n", net+3, rllx);
+#endif	
+      if (!L->_le) {
+	L->_le = new LayoutEdgeAttrib();
       }
-      else if (strncmp (net, "$t:", 3) == 0) {
-        
-	l->name = Strdup (net+3);
-  #if 0
-  printf("new marker %s top: %ld\n",l->name, rllx);
-  #endif	
-	l->offset = rllx; // top alignment: lower left corner x coord
-	if (!L->_le) {
-	  L->_le = new LayoutEdgeAttrib();
-	}
-	L->_le->mergetop (l);
+      // top alignment: lower left corner x coord
+      L->_le->add (LayoutEdgeAttrib::LE_TOP, net+3, rllx);
 #if 0	
-	printf (" >> got top: ");
-	LayoutEdgeAttrib::print (stdout, L->_le->top());
-	printf ("\n");
+      printf (" >> got top: ");
+      LayoutEdgeAttrib::print (stdout, L->_le->top());
+      printf ("\n");
 #endif	
+    }
+    else if (strncmp (net, "$b:", 3) == 0) {
+#if 0	
+printf("new marker %s bottom: %ld\n", net+3, rllx);
+#endif
+      if (!L->_le) {
+	L->_le = new LayoutEdgeAttrib();
       }
-      else if (strncmp (net, "$b:", 3) == 0) {
-        
-	l->name = Strdup (net+3);
-  #if 0	
-  printf("new marker %s bottom: %ld\n",l->name, rllx);
-  #endif
-	l->offset = rllx; // bot alignment: lower left corner x coord
-	if (!L->_le) {
-	  L->_le = new LayoutEdgeAttrib();
-	}
-	L->_le->mergebot (l);
+      // bot alignment: lower left corner x coord
+      L->_le->add (LayoutEdgeAttrib::LE_BOT, net+3, rllx);
 #if 0
-	printf (" >> got bot: ");
-	LayoutEdgeAttrib::print (stdout, L->_le->bot());
-	printf ("\n");
+      printf (" >> got bot: ");
+      LayoutEdgeAttrib::print (stdout, L->_le->bot());
+      printf ("\n");
 #endif
+    }
+    else {
+      warning ("Invalid alignment layer directive: `%s'; skipped", net);
+    }
+  }
+  else {
+    struct LayoutLayermap *lm;
+    hash_bucket_t *b;
+    b = hash_lookup (L->lmap, material);
+    if (b) {
+      const char *errname = NULL;
+      /*--- draw base layer or via ---*/
+      lm = (struct LayoutLayermap *) b->v;
+      switch (lm->lcase) {
+      case LMAP_DIFF:
+	if (!L->DrawDiff (lm->flavor, lm->etype, rllx, rlly,
+			  rurx - rllx, rury - rlly, n)) {
+	  errname = "diffusion";
+	}
+	break;
+	
+      case LMAP_FET:
+	if (!L->DrawFet (lm->flavor, lm->etype, rllx, rlly,
+			 rurx - rllx, rury - rlly, n)) {
+	  errname = "fet";
+	}
+	break;
+      case LMAP_WDIFF:
+	if (!L->DrawWellDiff (lm->flavor, lm->etype, rllx, rlly,
+			      rurx - rllx, rury - rlly, n)) {
+	  errname = "welldiff";
+	}
+	break;
+      case LMAP_VIA:
+	if (!lm->l->drawVia (rllx, rlly, rurx - rllx, rury - rlly, n, 0)) {
+	  errname = "via";
+	}
+	break;
+      default:
+	fatal_error ("Unknown lmap lcase %d?", lm->lcase);
+	break;
       }
-      else {
-	warning ("Invalid alignment layer directive: `%s'; skipped", net);
+      if (errname) {
+	warning ("Skipped rect %s: (%ld,%ld) -> (%ld,%ld)",
+		 errname, rllx, rlly, rurx, rury);
       }
-      FREE (l); // don't free name: that gets used by the merge
     }
     else {
-      struct LayoutLayermap *lm;
-      hash_bucket_t *b;
-      b = hash_lookup (L->lmap, material);
-      if (b) {
-	const char *errname = NULL;
-	/*--- draw base layer or via ---*/
-	lm = (struct LayoutLayermap *) b->v;
-	switch (lm->lcase) {
-	case LMAP_DIFF:
-	  if (!L->DrawDiff (lm->flavor, lm->etype, rllx, rlly,
-			    rurx - rllx, rury - rlly, n)) {
-	    errname = "diffusion";
+      int iswell = 0;
+      for (int i=0; i < Technology::T->num_devs; i++) {
+	for (int j=0; j < 2; j++) {
+	  if (Technology::T->well[j][i]) {
+	    if (strcmp (material, Technology::T->well[j][i]->getName()) == 0) {
+	      iswell = 1;
+	      break;
+	    }
 	  }
-	  break;
-	  
-	case LMAP_FET:
-	  if (!L->DrawFet (lm->flavor, lm->etype, rllx, rlly,
-			   rurx - rllx, rury - rlly, n)) {
-	    errname = "fet";
+	  if (iswell) {
+	    break;
 	  }
+	}
+      }
+      if (!iswell) {
+	warning ("Unknown material `%s'; skipped", material);
+      }
+      /* skip wells! */
+    }
+  }
+}
+
+
+/*------------------------------------------------------------------------
+ *
+ *  .rectb: binary form of a .rect file
+ *
+ *  A .rectb file caches the tokenized contents of a .rect file:
+ *     - header
+ *     - string table: NUL-terminated net and material names
+ *     - records: one per rect/bbox/sbox/cell line, in file order; a
+ *       cell array is followed by an extra record with the array
+ *       dimensions
+ *
+ *  The header records the size, mtime, and hash of the text file it
+ *  was created from, and the cache is only used if the text file has
+ *  not changed.
+ *
+ *------------------------------------------------------------------------
+ */
+#define RECTB_MAGIC "ACTRECTB"
+#define RECTB_VERSION 2
+
+#define RECTB_RECT 0
+#define RECTB_BBOX 1
+#define RECTB_SBOX 2
+#define RECTB_CELL 3		// net = cell type, mat = instance,
+				// aux = orientation, c = dx, dy
+#define RECTB_ARR  4		// c = nx, px, ny, py of the previous cell
+
+struct rectb_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t pad;
+  uint64_t src_size;
+  int64_t src_mtime;
+  uint64_t src_hash;
+  uint64_t strtab_sz;		// bytes, padded to a multiple of 8
+  uint64_t nrecs;
+};
+
+struct rectb_rec {
+  int32_t kind;
+  int32_t net;			// string table offset, -1 if none
+  int32_t mat;			// string table offset, -1 if none
+  int32_t aux;			// string table offset, -1 if none
+  int64_t c[4];			// llx, lly, urx, ury
+};
+
+struct rectb_builder {
+  Hashtable *H;			// string -> string table offset
+  char *strs;
+  size_t strs_len, strs_max;
+  A_DECL (rectb_rec, recs);
+};
+
+/* FNV-1a */
+static uint64_t _rectb_hash (const char *data, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i=0; i < len; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+bool LayoutBlob::RectHash (const char *file, unsigned long *hash)
+{
+  int fd;
+  struct stat st;
+  char *data;
+
+  fd = open (file, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  if (fstat (fd, &st) != 0) {
+    close (fd);
+    return false;
+  }
+  if (st.st_size == 0) {
+    close (fd);
+    *hash = _rectb_hash (NULL, 0);
+    return true;
+  }
+  data = (char *) mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == (char *)MAP_FAILED) {
+    return false;
+  }
+  *hash = _rectb_hash (data, st.st_size);
+  munmap (data, st.st_size);
+  return true;
+}
+
+static char *_rectb_name (const char *file, const char *cachedir)
+{
+  char *ret;
+  int sz;
+  if (cachedir) {
+    const char *base = strrchr (file, '/');
+    int blen;
+    base = base ? base + 1 : file;
+    blen = strlen (base);
+    if (blen > 3 && strcmp (base + blen - 3, ".gz") == 0) {
+      blen -= 3;
+    }
+    sz = strlen (cachedir) + blen + 3;
+    MALLOC (ret, char, sz);
+    snprintf (ret, sz, "%s/%.*sb", cachedir, blen, base);
+  }
+  else {
+    int flen = strlen (file);
+    /* X.rect.gz and X.rect share the cache X.rectb */
+    if (flen > 3 && strcmp (file + flen - 3, ".gz") == 0) {
+      flen -= 3;
+    }
+    sz = flen + 2;
+    MALLOC (ret, char, sz);
+    snprintf (ret, sz, "%.*sb", flen, file);
+  }
+  return ret;
+}
+
+static rectb_builder *_rectb_new ()
+{
+  rectb_builder *rb;
+  NEW (rb, rectb_builder);
+  rb->H = hash_new (16);
+  rb->strs = NULL;
+  rb->strs_len = 0;
+  rb->strs_max = 0;
+  A_INIT (rb->recs);
+  return rb;
+}
+
+static void _rectb_free (rectb_builder *rb)
+{
+  hash_free (rb->H);
+  if (rb->strs) {
+    FREE (rb->strs);
+  }
+  A_FREE (rb->recs);
+  FREE (rb);
+}
+
+static int32_t _rectb_str (rectb_builder *rb, const char *s)
+{
+  hash_bucket_t *b;
+  if (!s) {
+    return -1;
+  }
+  b = hash_lookup (rb->H, s);
+  if (b) {
+    return b->i;
+  }
+  size_t len = strlen (s) + 1;
+  if (rb->strs_len + len > rb->strs_max) {
+    rb->strs_max = rb->strs_len + len + 4096;
+    REALLOC (rb->strs, char, rb->strs_max);
+  }
+  memcpy (rb->strs + rb->strs_len, s, len);
+  b = hash_add (rb->H, s);
+  b->i = rb->strs_len;
+  rb->strs_len += len;
+  return b->i;
+}
+
+static void _rectb_add (rectb_builder *rb, int kind, const char *net,
+			const char *mat, long llx, long lly, long urx, long ury)
+{
+  A_NEW (rb->recs, rectb_rec);
+  A_NEXT (rb->recs).kind = kind;
+  A_NEXT (rb->recs).net = _rectb_str (rb, net);
+  A_NEXT (rb->recs).mat = _rectb_str (rb, mat);
+  A_NEXT (rb->recs).aux = -1;
+  A_NEXT (rb->recs).c[0] = llx;
+  A_NEXT (rb->recs).c[1] = lly;
+  A_NEXT (rb->recs).c[2] = urx;
+  A_NEXT (rb->recs).c[3] = ury;
+  A_INC (rb->recs);
+}
+
+static void _rectb_cell (rectb_builder *rb, const char *type,
+			 const char *inst, const char *orient, long dx, long dy)
+{
+  _rectb_add (rb, RECTB_CELL, type, inst, dx, dy, 0, 0);
+  rb->recs[A_LEN (rb->recs)-1].aux = _rectb_str (rb, orient);
+}
+
+/*
+ * Write the cache; the file is written to a temporary and renamed so
+ * that readers never see a partial file. Failure to write the cache
+ * is not an error.
+ */
+static void _rectb_write (rectb_builder *rb, const char *cname,
+			  struct stat *st, uint64_t hash)
+{
+  rectb_header h;
+  char *tmpname;
+  int sz, fd;
+  FILE *fp;
+  static const char zeros[8] = { 0 };
+
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, RECTB_MAGIC, 8);
+  h.version = RECTB_VERSION;
+  h.src_size = st->st_size;
+  h.src_mtime = st->st_mtime;
+  h.src_hash = hash;
+  h.strtab_sz = (rb->strs_len + 7) & ~((size_t)7);
+  h.nrecs = A_LEN (rb->recs);
+
+  sz = strlen (cname) + 8;
+  MALLOC (tmpname, char, sz);
+  snprintf (tmpname, sz, "%s.XXXXXX", cname);
+  fd = mkstemp (tmpname);
+  if (fd < 0) {
+    FREE (tmpname);
+    return;
+  }
+  fp = fdopen (fd, "w");
+  if (!fp) {
+    close (fd);
+    unlink (tmpname);
+    FREE (tmpname);
+    return;
+  }
+  bool ok = true;
+  ok = ok && fwrite (&h, sizeof (h), 1, fp) == 1;
+  if (rb->strs_len > 0) {
+    ok = ok && fwrite (rb->strs, 1, rb->strs_len, fp) == rb->strs_len;
+  }
+  if (h.strtab_sz > rb->strs_len) {
+    ok = ok && fwrite (zeros, 1, h.strtab_sz - rb->strs_len, fp) ==
+      h.strtab_sz - rb->strs_len;
+  }
+  if (A_LEN (rb->recs) > 0) {
+    ok = ok && fwrite (rb->recs, sizeof (rectb_rec), A_LEN (rb->recs), fp) ==
+      (size_t)A_LEN (rb->recs);
+  }
+  if (fclose (fp) != 0) {
+    ok = false;
+  }
+  if (!ok || rename (tmpname, cname) != 0) {
+    unlink (tmpname);
+  }
+  FREE (tmpname);
+}
+
+/*
+ * Map the cache for a text .rect file with the given stat info, if it
+ * is valid. Returns the mapped file (and its size in *csz), or NULL.
+ */
+static char *_rectb_open (const char *cname, const char *file,
+			  struct stat *st, size_t *csz)
+{
+  struct stat cst;
+  int fd;
+  char *data;
+  rectb_header *h;
+  rectb_rec *recs;
+  const char *strs;
+
+  fd = open (cname, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat (fd, &cst) != 0 || (size_t)cst.st_size < sizeof (rectb_header)) {
+    close (fd);
+    return NULL;
+  }
+  data = (char *) mmap (NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == (char *)MAP_FAILED) {
+    return NULL;
+  }
+
+  h = (rectb_header *) data;
+  bool valid = true;
+  if (memcmp (h->magic, RECTB_MAGIC, 8) != 0 ||
+      h->version != RECTB_VERSION ||
+      h->src_size != (uint64_t)st->st_size ||
+      (h->strtab_sz & 7) != 0 ||
+      h->strtab_sz > (uint64_t)cst.st_size ||
+      sizeof (rectb_header) + h->strtab_sz + h->nrecs*sizeof (rectb_rec) !=
+      (uint64_t)cst.st_size) {
+    valid = false;
+  }
+  else if (h->src_mtime != st->st_mtime || cst.st_mtime <= st->st_mtime) {
+    /* timestamps are inconclusive; check the contents */
+    int tfd = open (file, O_RDONLY);
+    valid = false;
+    if (tfd >= 0) {
+      if (st->st_size == 0) {
+	valid = (h->src_hash == _rectb_hash (NULL, 0));
+      }
+      else {
+	char *tdata = (char *) mmap (NULL, st->st_size, PROT_READ,
+				     MAP_PRIVATE, tfd, 0);
+	if (tdata != (char *)MAP_FAILED) {
+	  valid = (h->src_hash == _rectb_hash (tdata, st->st_size));
+	  munmap (tdata, st->st_size);
+	}
+      }
+      close (tfd);
+    }
+  }
+
+  strs = data + sizeof (rectb_header);
+  recs = (rectb_rec *) (strs + (valid ? h->strtab_sz : 0));
+
+  if (valid) {
+    /* check all string references before using any of them */
+    if (h->strtab_sz > 0 && strs[h->strtab_sz-1] != '\0') {
+      valid = false;
+    }
+    for (uint64_t i=0; valid && i < h->nrecs; i++) {
+      if (recs[i].net >= (int64_t)h->strtab_sz ||
+	  recs[i].mat >= (int64_t)h->strtab_sz ||
+	  recs[i].aux >= (int64_t)h->strtab_sz ||
+	  recs[i].kind < RECTB_RECT || recs[i].kind > RECTB_ARR ||
+	  (recs[i].kind == RECTB_RECT && recs[i].mat < 0)) {
+	valid = false;
+      }
+      else if (recs[i].kind == RECTB_CELL &&
+	       (recs[i].net < 0 || recs[i].mat < 0 || recs[i].aux < 0)) {
+	valid = false;
+      }
+      else if (recs[i].kind == RECTB_ARR &&
+	       (i == 0 || recs[i-1].kind != RECTB_CELL ||
+		recs[i].c[0] < 1 || recs[i].c[2] < 1)) {
+	valid = false;
+      }
+    }
+  }
+
+  if (!valid) {
+    munmap (data, cst.st_size);
+    return NULL;
+  }
+  *csz = cst.st_size;
+  return data;
+}
+
+
+/*
+ * Compressed .rect files (.rect.gz) are decompressed in large blocks
+ * that are handed to the tokenizer one run of complete lines at a
+ * time.
+ */
+#define RECT_GZBLOCK (1 << 20)
+
+static bool _rect_isgz (const char *file)
+{
+  int len = strlen (file);
+  return len > 3 && strcmp (file + len - 3, ".gz") == 0;
+}
+
+/*
+ * Move the partial line at the end of the last block to the front of
+ * the buffer, and decompress more data after it. On return [*cur,
+ * *end) holds complete lines, or whatever is left at the end of the
+ * file. Returns false when there is nothing left.
+ */
+static bool _rect_gzfill (gzFile gz, const char *file,
+			  char **buf, size_t *len, size_t *max,
+			  const char **cur, const char **end)
+{
+  size_t keep;
+  int n;
+
+  if (!*buf) {
+    *max = RECT_GZBLOCK;
+    MALLOC (*buf, char, *max);
+    keep = 0;
+  }
+  else {
+    keep = (*buf + *len) - *end;
+    memmove (*buf, *end, keep);
+  }
+  *len = keep;
+
+  while (1) {
+    if (*len == *max) {
+      /* a very long line */
+      *max = 2*(*max);
+      REALLOC (*buf, char, *max);
+    }
+    n = gzread (gz, *buf + *len, *max - *len);
+    if (n < 0) {
+      int err;
+      fatal_error ("%s: %s", file, gzerror (gz, &err));
+    }
+    if (n == 0) {
+      *cur = *buf;
+      *end = *buf + *len;
+      return *len > 0;
+    }
+    *len += n;
+    for (size_t i = *len; i > keep; i--) {
+      if ((*buf)[i-1] == '\n') {
+	*cur = *buf;
+	*end = *buf + i;
+	return true;
+      }
+    }
+    keep = *len;
+  }
+}
+
+/*
+ * Create a subcell instance of the given cell type. The geometry for
+ * the type is shared by all its instances; if it hasn't been
+ * registered yet, it is read in from <type>.rect in the same
+ * directory as file. Returns NULL if the type can't be found.
+ */
+static thread_local int _rect_depth = 0;
+
+static LayoutBlob *_rect_subcell (const char *file, const char *type,
+				  const char *inst, const char *orient,
+				  long dx, long dy,
+				  long nx, long px, long ny, long py,
+				  int mode, int cache, const char *cachedir)
+{
+  LayoutBlob *b, *own;
+
+  own = NULL;
+  b = LayoutBlob::findOrClaimCell (type);
+  if (!b) {
+    const char *slash = strrchr (file, '/');
+    int dlen = slash ? (slash - file + 1) : 0;
+    char *cfile;
+    Rectangle cbox;
+
+    if (_rect_depth > 100) {
+      fatal_error ("%s: cell `%s' nested too deeply; recursive cell?",
+		   file, type);
+    }
+    MALLOC (cfile, char, dlen + strlen (type) + 6);
+    snprintf (cfile, dlen + strlen (type) + 6, "%.*s%s.rect", dlen, file,
+	      type);
+    _rect_depth++;
+    b = LayoutBlob::ReadRect (cfile, NULL, cbox, mode, cache, cachedir);
+    _rect_depth--;
+    if (!b) {
+      FREE (cfile);
+      LayoutBlob::abandonCell (type);
+      return NULL;
+    }
+    b->markRead ();
+    /* remembered so that the cell can be refreshed */
+    LayoutBlob::setCellFile (type, cfile);
+    FREE (cfile);
+    LayoutBlob::registerCell (type, b);
+    own = b;
+  }
+
+  TransformMat m = TransformMat::ReadRect (orient, dx, dy);
+  SubcellInst *si = new SubcellInst (b, inst, type, &m);
+  if (nx != 1 || ny != 1) {
+    si->mkArray (nx, px, ny, py);
+  }
+  /* the registry and the instance hold the cell now */
+  LayoutBlob::decRef (own);
+  return new LayoutBlob (si);
+}
+
+/*
+ * The result of reading a .rect file: the local geometry, merged with
+ * any subcell instances
+ */
+static LayoutBlob *_rect_result (Layout *L, list_t *cells)
+{
+  LayoutBlob *ret = new LayoutBlob (BLOB_BASE, L);
+
+  if (!list_isempty (cells)) {
+    LayoutBlob *tmp = new LayoutBlob (BLOB_LIST);
+    tmp->appendBlob (ret, BLOB_MERGE);
+    for (listitem_t *li = list_first (cells); li; li = list_next (li)) {
+      tmp->appendBlob ((LayoutBlob *) list_value (li), BLOB_MERGE);
+    }
+    ret = tmp;
+  }
+  list_free (cells);
+  return ret;
+}
+
+/*
+ * Report and release the per-file net name table
+ */
+static void _rect_netstats (int mode, Hashtable *nets, int hits)
+{
+  if (mode == 3 || mode == 5) {
+    fprintf (LayoutBlob::rectInfo (),
+	     "INFO: resolved %d distinct nets, %d cached lookups\n",
+	     nets->n, hits);
+  }
+  hash_free (nets);
+}
+
+
+LayoutBlob *LayoutBlob::ReadRect (const char *file, netlist_t *nl,
+				  Rectangle& bbox, int mode,
+				  int cache, const char *cachedir)
+{
+  LayoutBlob *ret;
+  int fd;
+  struct stat st;
+  char *data;
+  bool mapped;
+  const char *cur, *end;
+  int lineno;
+  Process *p;
+  Layout *L;
+  char *netbuf;
+  int netbuf_sz;
+  char *cname;
+  rectb_builder *rb;
+  Hashtable *nets;
+  int hits;
+  list_t *cells;
+  char *gzname;
+  gzFile gz;
+  char *zbuf;
+  size_t zlen, zmax;
+
+  bbox.clear ();
+
+  /* the process */
+  if (nl) {
+    p = nl->bN->p;
+    Assert (p->isExpanded(), "What?");
+  }
+  else {
+    p = NULL;
+  }
+
+  gzname = NULL;
+  fd = open (file, O_RDONLY);
+  if (fd < 0 && !_rect_isgz (file)) {
+    /* look for a compressed version */
+    MALLOC (gzname, char, strlen (file) + 4);
+    snprintf (gzname, strlen (file) + 4, "%s.gz", file);
+    fd = open (gzname, O_RDONLY);
+    file = gzname;
+  }
+  if (fd < 0) {
+    if (gzname) {
+      FREE (gzname);
+    }
+    return NULL;
+  }
+  if (fstat (fd, &st) != 0) {
+    close (fd);
+    if (gzname) {
+      FREE (gzname);
+    }
+    return NULL;
+  }
+
+  if (mode == 3 || mode == 5) {
+    fprintf (LayoutBlob::rectInfo (), "INFO: read rect: %s\n", file);
+  }
+
+  L = new Layout (nl);
+  L->_readrect = true;
+  L->_rbox.clear ();
+
+  nets = hash_new (16);
+  hits = 0;
+  cells = list_new ();
+
+  cname = NULL;
+  rb = NULL;
+  if (cache) {
+    size_t csz;
+    cname = _rectb_name (file, cachedir);
+    data = _rectb_open (cname, file, &st, &csz);
+    if (data) {
+      rectb_header *h = (rectb_header *) data;
+      const char *strs = data + sizeof (rectb_header);
+      rectb_rec *recs = (rectb_rec *) (strs + h->strtab_sz);
+
+      close (fd);
+      FREE (cname);
+      if (mode == 3 || mode == 5) {
+	fprintf (LayoutBlob::rectInfo (),
+		 "INFO: using cached binary rect file\n");
+      }
+      for (uint64_t i=0; i < h->nrecs; i++) {
+	rectb_rec *r = &recs[i];
+	switch (r->kind) {
+	case RECTB_BBOX:
+	  bbox.setRect (r->c[0], r->c[1], r->c[2] - r->c[0], r->c[3] - r->c[1]);
 	  break;
-	case LMAP_WDIFF:
-	  if (!L->DrawWellDiff (lm->flavor, lm->etype, rllx, rlly,
-				rurx - rllx, rury - rlly, n)) {
-	    errname = "welldiff";
-	  }
+	case RECTB_SBOX:
+	  L->_rbox.setRect (r->c[0], r->c[1],
+			    r->c[2] - r->c[0], r->c[3] - r->c[1]);
+	  break;
+	case RECTB_RECT:
+	  _readRectDraw (L, nl, nets, &hits,
+			 r->net < 0 ? NULL : strs + r->net,
+			 strs + r->mat, r->c[0], r->c[1], r->c[2], r->c[3]);
 	  break;
-	case LMAP_VIA:
-	  if (!lm->l->drawVia (rllx, rlly, rurx - rllx, rury - rlly, n, 0)) {
-	    errname = "via";
+	case RECTB_CELL:
+	  {
+	    long nx = 1, px = 0, ny = 1, py = 0;
+	    LayoutBlob *cb;
+	    if (i + 1 < h->nrecs && recs[i+1].kind == RECTB_ARR) {
+	      nx = recs[i+1].c[0];
+	      px = recs[i+1].c[1];
+	      ny = recs[i+1].c[2];
+	      py = recs[i+1].c[3];
+	    }
+	    cb = _rect_subcell (file, strs + r->net, strs + r->mat,
+				strs + r->aux, r->c[0], r->c[1],
+				nx, px, ny, py, mode, cache, cachedir);
+	    if (!cb) {
+	      fatal_error ("%s: cell type `%s' not found", file,
+			   strs + r->net);
+	    }
+	    list_append (cells, cb);
 	  }
 	  break;
-	default:
-	  fatal_error ("Unknown lmap lcase %d?", lm->lcase);
+	case RECTB_ARR:
+	  /* consumed by the cell record */
 	  break;
 	}
-	if (errname) {
-	  warning ("Skipped rect %s: (%ld,%ld) -> (%ld,%ld)",
-		   errname, rllx, rlly, rurx, rury);
+      }
+      munmap (data, csz);
+      if (gzname) {
+	FREE (gzname);
+      }
+      _rect_netstats (mode, nets, hits);
+      L->propagateAllNets ();
+      L->markPins();
+      return _rect_result (L, cells);
+    }
+    rb = _rectb_new ();
+  }
+
+  data = NULL;
+  mapped = false;
+  gz = NULL;
+  if (_rect_isgz (file)) {
+    /* decompressed in blocks as it is parsed */
+    gz = gzdopen (fd, "rb");
+    if (!gz) {
+      fatal_error ("%s: could not open compressed file", file);
+    }
+    gzbuffer (gz, RECT_GZBLOCK);
+    fd = -1;
+  }
+  else if (st.st_size > 0) {
+    data = (char *) mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == (char *)MAP_FAILED) {
+      /* not mappable; just read it in */
+      size_t pos = 0;
+      ssize_t n;
+      MALLOC (data, char, st.st_size);
+      while (pos < (size_t)st.st_size &&
+	     (n = read (fd, data + pos, st.st_size - pos)) > 0) {
+	pos += n;
+      }
+      if (pos != (size_t)st.st_size) {
+	/* short read; don't cache this */
+	st.st_size = pos;
+	if (rb) {
+	  _rectb_free (rb);
+	  rb = NULL;
 	}
       }
+    }
+    else {
+      mapped = true;
+      madvise (data, st.st_size, MADV_SEQUENTIAL);
+    }
+  }
+  if (fd >= 0) {
+    close (fd);
+  }
+
+  netbuf_sz = 1024;
+  MALLOC (netbuf, char, netbuf_sz);
+
+  cur = data;
+  end = data + (gz ? 0 : st.st_size);
+  lineno = 0;
+  zbuf = NULL;
+  zlen = 0;
+  zmax = 0;
+
+  for (;;) {
+    if (gz && !_rect_gzfill (gz, file, &zbuf, &zlen, &zmax, &cur, &end)) {
+      break;
+    }
+    while (cur < end) {
+      const char *line, *eol, *pos;
+      rect_tok kw, nettok, mattok;
+      char *net;
+      char material[1024];
+
+      line = cur;
+      eol = (const char *) memchr (cur, '\n', end - cur);
+      if (!eol) {
+	eol = end;
+	cur = end;
+      }
       else {
-	int iswell = 0;
-	for (int i=0; i < Technology::T->num_devs; i++) {
-	  for (int j=0; j < 2; j++) {
-	    if (Technology::T->well[j][i]) {
-	      if (strcmp (material, Technology::T->well[j][i]->getName()) == 0) {
-		iswell = 1;
-		break;
-	      }
-	    }
-	    if (iswell) {
-	      break;
-	    }
+	cur = eol + 1;
+      }
+      lineno++;
+      pos = line;
+
+#define LINE_ERR(msg)						\
+      fatal_error ("%s:%d: %.*s\n" msg, file, lineno, (int)(eol - line), line)
+
+#if 0
+      printf ("BUF: %.*s\n", (int)(eol - line), line);
+#endif    
+      if (!_rect_token (&pos, eol, &kw)) continue;
+      if (kw.s[0] == '#') continue;
+      if (_tok_eq (kw, "inrect") || _tok_eq (kw, "outrect") ||
+	  _tok_eq (kw, "rect")) {
+	/* rectangle; parsed below */
+      }
+      else if (_tok_eq (kw, "bbox")) {
+	long rlx, rly, rux, ruy;
+	if (!_rect_long (&pos, eol, &rlx) || !_rect_long (&pos, eol, &rly) ||
+	    !_rect_long (&pos, eol, &rux) || !_rect_long (&pos, eol, &ruy)) {
+	  LINE_ERR ("bbox spec error");
+	}
+	// this is auto-generated, so ignore it.
+	bbox.setRect (rlx, rly, rux - rlx, ruy - rly);
+	if (rb) {
+	  _rectb_add (rb, RECTB_BBOX, NULL, NULL, rlx, rly, rux, ruy);
+	}
+	continue;
+      }
+      else if (_tok_eq (kw, "sbox")) {
+	// this overrides the bbox definition, so keep it
+	long rlx, rly, rux, ruy;
+	if (!_rect_long (&pos, eol, &rlx) || !_rect_long (&pos, eol, &rly) ||
+	    !_rect_long (&pos, eol, &rux) || !_rect_long (&pos, eol, &ruy)) {
+	  LINE_ERR ("sbox spec error");
+	}
+	L->_rbox.setRect (rlx, rly, rux - rlx, ruy - rly);
+	if (rb) {
+	  _rectb_add (rb, RECTB_SBOX, NULL, NULL, rlx, rly, rux, ruy);
+	}
+	continue;
+      }
+      else if (_tok_eq (kw, "cell")) {
+	rect_tok celltype, inst, orient, arr;
+	char obuf[32];
+	long dx, dy;
+	long nx, px, ny, py;
+	/* celltype id orientation dx dy [arr nx px ny py] */
+	if (!_rect_token (&pos, eol, &celltype) ||
+	    !_rect_token (&pos, eol, &inst) ||
+	    !_rect_token (&pos, eol, &orient) ||
+	    !_rect_long (&pos, eol, &dx) || !_rect_long (&pos, eol, &dy)) {
+	  LINE_ERR ("cell spec error");
+	}
+	snprintf (obuf, 32, "%.*s", orient.len, orient.s);
+	if (_rect_token (&pos, eol, &arr)) {
+	  if (!_tok_eq (arr, "arr") ||
+	      !_rect_long (&pos, eol, &nx) || !_rect_long (&pos, eol, &px) ||
+	      !_rect_long (&pos, eol, &ny) || !_rect_long (&pos, eol, &py) ||
+	      _rect_token (&pos, eol, &arr) || nx < 1 || ny < 1) {
+	    LINE_ERR ("cell spec error");
 	  }
 	}
-	if (!iswell) {
-	  warning ("Unknown material `%s'; skipped", material);
+	else {
+	  nx = 1;
+	  ny = 1;
+	  px = 0;
+	  py = 0;
+	}
+	// the geometry for the cell type is shared by all instances
+	char *ctype = _tok_dup (celltype, 0);
+	char *cinst = _tok_dup (inst, 0);
+	LayoutBlob *cb = _rect_subcell (file, ctype, cinst, obuf, dx, dy,
+					nx, px, ny, py, mode, cache, cachedir);
+	if (!cb) {
+	  LINE_ERR ("cell type not found");
+	}
+	list_append (cells, cb);
+	if (rb) {
+	  _rectb_cell (rb, ctype, cinst, obuf, dx, dy);
+	  if (nx != 1 || ny != 1) {
+	    _rectb_add (rb, RECTB_ARR, NULL, NULL, nx, px, ny, py);
+	  }
 	}
-	/* skip wells! */
+	FREE (ctype);
+	FREE (cinst);
+	continue;
+      }
+      else {
+	LINE_ERR ("Needs inrect, outrect, rect, bbox, sbox, or cell");
+      }
+
+      if (!_rect_token (&pos, eol, &nettok) ||
+	  !_rect_token (&pos, eol, &mattok)) {
+	LINE_ERR ("rect spec error");
       }
+
+      long rllx, rlly, rurx, rury;
+      if (!_rect_long (&pos, eol, &rllx) || !_rect_long (&pos, eol, &rlly) ||
+	  !_rect_long (&pos, eol, &rurx) || !_rect_long (&pos, eol, &rury)) {
+	LINE_ERR ("rect spec error");
+      }
+#undef LINE_ERR
+
+      if (mattok.len >= (int)sizeof (material)) {
+	warning ("Unknown material `%.*s'; skipped", mattok.len, mattok.s);
+	continue;
+      }
+      memcpy (material, mattok.s, mattok.len);
+      material[mattok.len] = '\0';
+
+      if (_tok_eq (nettok, "#")) {
+	net = NULL;
+      }
+      else {
+	net = _tok_str (nettok, &netbuf, &netbuf_sz);
+      }
+
+      _readRectDraw (L, nl, nets, &hits, net, material,
+		     rllx, rlly, rurx, rury);
+      if (rb) {
+	_rectb_add (rb, RECTB_RECT, net, material, rllx, rlly, rurx, rury);
+      }
+    }
+    if (!gz) {
+      break;
+    }
+  }
+  FREE (netbuf);
+  if (gz) {
+    gzclose (gz);
+    FREE (zbuf);
+  }
+
+  if (rb) {
+    unsigned long h;
+    if (!gz) {
+      _rectb_write (rb, cname, &st, _rectb_hash (data, st.st_size));
+    }
+    else if (RectHash (file, &h)) {
+      _rectb_write (rb, cname, &st, h);
     }
+    _rectb_free (rb);
+  }
+  if (cname) {
+    FREE (cname);
+  }
+
+  if (mapped) {
+    munmap (data, st.st_size);
+  }
+  else if (data) {
+    FREE (data);
+  }
+  if (gzname) {
+    FREE (gzname);
   }
-  fclose (fp);
+  _rect_netstats (mode, nets, hits);
 
   L->propagateAllNets ();
   L->markPins();
   
-  ret = new LayoutBlob (BLOB_BASE, L);
+  ret = _rect_result (L, cells);
   
   return ret;
 }
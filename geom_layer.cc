@@ -53,6 +53,9 @@ Layer::Layer (Material *m, netlist_t *_n)
   nother = 0;
   bbox = 0;
 
+  A_INIT (_attrbox);
+  _attrbox_valid = 1;
+
   hint = new Tile();
   vhint = new Tile();
 
@@ -62,7 +65,29 @@ Layer::Layer (Material *m, netlist_t *_n)
 
 Layer::~Layer()
 {
-  /* XXX: delete all tiles! */
+  Tile *planes[2];
+
+  planes[0] = hint;
+  planes[1] = vhint;
+
+  /* each plane owns all its tiles, including space tiles */
+  for (int i=0; i < 2; i++) {
+    list_t *l = planes[i]->collectRect (MIN_VALUE, MIN_VALUE,
+				(unsigned long)MAX_VALUE + -(MIN_VALUE + 1),
+				(unsigned long)MAX_VALUE + -(MIN_VALUE + 1));
+    while (!list_isempty (l)) {
+      Tile *t = (Tile *) list_delete_tail (l);
+      delete t;
+    }
+    list_free (l);
+  }
+  hint = NULL;
+  vhint = NULL;
+
+  if (other) {
+    FREE (other);
+  }
+  A_FREE (_attrbox);
 }
 
 void Layer::allocOther (int sz)
@@ -158,6 +183,11 @@ int Layer::Draw (long llx, long lly, unsigned long wx, unsigned long wy,
   if (net) {
     x->net = net;
   }
+  if (_attrbox_valid) {
+    Rectangle r;
+    r.setRect (llx, lly, wx, wy);
+    _growAttrBox (attr, r);
+  }
   return 1;
 }
 
@@ -165,6 +195,8 @@ int Layer::DrawVirt (int flavor, int type,
 		     long llx, long lly, unsigned long wx, unsigned long wy)
 {
   bbox = 0;
+  /* this changes the attributes of existing tiles */
+  _attrbox_valid = 0;
   return hint->addVirt (flavor, type, llx, lly, wx, wy);
 }
 
@@ -180,6 +212,7 @@ void Layer::markPins (void *net, int isinput)
 
   list_t *l = searchMat (net);
 
+  _attrbox_valid = 0;
   for (listitem_t *li = list_first (l); li; li = list_next (li)) {
     Tile *t = (Tile *) list_value (li);
 #if 0
@@ -562,77 +595,213 @@ static void appendtype (void *cookie, Tile *t)
   }
 }
 
-list_t *Layer::searchMat (void *net)
+/*
+  Apply fn to all tiles in t that overlap the search window r; the
+  entire plane is searched if r is NULL.
+*/
+void Layer::_searchwindow (Tile *t, const Rectangle *r, void *cookie,
+			   void (*fn) (void *, Tile *))
+{
+  if (!r) {
+    t->applyTiles (MIN_VALUE, MIN_VALUE,
+		   (unsigned long)MAX_VALUE + -(MIN_VALUE + 1),
+		   (unsigned long)MAX_VALUE + -(MIN_VALUE + 1), cookie, fn);
+  }
+  else if (!r->empty()) {
+    t->applyTiles (r->llx(), r->lly(), r->wx(), r->wy(), cookie, fn);
+  }
+}
+
+list_t *Layer::searchMat (void *net, const Rectangle *r)
 {
   list_t *l = list_new ();
   _searchnet = net;
-  hint->applyTiles (MIN_VALUE, MIN_VALUE,
-		    (unsigned long)MAX_VALUE + -(MIN_VALUE + 1),
-		    (unsigned long)MAX_VALUE + -(MIN_VALUE + 1), l, appendnet);
+  _searchwindow (hint, r, l, appendnet);
   _searchnet = NULL;
   return l;
 }
 
-list_t *Layer::searchMat (int type)
+list_t *Layer::searchMat (int type, const Rectangle *r)
 {
   list_t *l = list_new ();
   _searchtype = type;
-  hint->applyTiles (MIN_VALUE, MIN_VALUE,
-		    (unsigned long)MAX_VALUE + -(MIN_VALUE + 1),
-		    (unsigned long)MAX_VALUE + -(MIN_VALUE + 1), l, appendtype);
+  _searchwindow (hint, r, l, appendtype);
   return l;
 }
 
-list_t *Layer::searchVia (void *net)
+list_t *Layer::searchVia (void *net, const Rectangle *r)
 {
   list_t *l = list_new ();
   _searchnet = net;
-  vhint->applyTiles (MIN_VALUE, MIN_VALUE,
-		    (unsigned long)MAX_VALUE + -(MIN_VALUE + 1),
-		    (unsigned long)MAX_VALUE + -(MIN_VALUE + 1), l, appendnet);
+  _searchwindow (vhint, r, l, appendnet);
   _searchnet = NULL;
   return l;
 }
 
-list_t *Layer::searchVia (int type)
+list_t *Layer::searchVia (int type, const Rectangle *r)
 {
   list_t *l = list_new ();
   _searchtype = type;
-  vhint->applyTiles (MIN_VALUE, MIN_VALUE,
-		    (unsigned long)MAX_VALUE + -(MIN_VALUE + 1),
-		    (unsigned long)MAX_VALUE + -(MIN_VALUE + 1), l, appendtype);
+  _searchwindow (vhint, r, l, appendtype);
   return l;
 }
 
-list_t *Layer::allNonSpaceMat ()
+list_t *Layer::allNonSpaceMat (const Rectangle *r)
 {
   list_t *l = list_new ();
 
   if (isMetal()) {
-    hint->applyTiles (MIN_VALUE, MIN_VALUE,
-		      (unsigned long)MAX_VALUE + -(MIN_VALUE + 1),
-		      (unsigned long)MAX_VALUE + -(MIN_VALUE + 1), l,
-		      append_nonspacetile);
+    _searchwindow (hint, r, l, append_nonspacetile);
   }
   else {
-    hint->applyTiles (MIN_VALUE, MIN_VALUE,
-		      (unsigned long)MAX_VALUE + -(MIN_VALUE + 1),
-		      (unsigned long)MAX_VALUE + -(MIN_VALUE + 1), l,
-		      append_nonspacebasetile);
+    _searchwindow (hint, r, l, append_nonspacebasetile);
   }
   return l;
 }
 
-list_t *Layer::allNonSpaceVia ()
+list_t *Layer::allNonSpaceVia (const Rectangle *r)
 {
   list_t *l = list_new ();
-  vhint->applyTiles (MIN_VALUE, MIN_VALUE,
-		    (unsigned long)MAX_VALUE + -(MIN_VALUE + 1),
-		    (unsigned long)MAX_VALUE + -(MIN_VALUE + 1), l,
-		    append_nonspacetile);
+  _searchwindow (vhint, r, l, append_nonspacetile);
   return l;
 }
 
+struct flat_cookie {
+  search_buf *b;
+  int layer;
+  int leaf;
+  int what;
+  void *net;
+  unsigned int attr;
+};
+
+static void append_flat (void *cookie, Tile *t)
+{
+  struct flat_cookie *fc = (struct flat_cookie *) cookie;
+  struct flat_rect *r;
+
+  if (fc->what == RECT_NET) {
+    if (t->getNet () != fc->net) {
+      return;
+    }
+  }
+  else if (fc->what == RECT_ATTR) {
+    if (t->getAttr () != fc->attr) {
+      return;
+    }
+  }
+  else if (t->isSpace()) {
+    return;
+  }
+
+  /* untransformed; appendRects() transforms the batch */
+  A_NEW (fc->b->r, struct flat_rect);
+  r = &A_NEXT (fc->b->r);
+  r->llx = t->getllx ();
+  r->lly = t->getlly ();
+  r->urx = t->geturx ();
+  r->ury = t->getury ();
+  r->net = t->getNet ();
+  r->attr = t->getAttr ();
+  r->layer = fc->layer;
+  r->leaf = fc->leaf;
+  r->virt = t->isVirt () ? 1 : 0;
+  r->fet = t->isFet () ? 1 : 0;
+  r->diff = t->isDiff () ? 1 : 0;
+  A_INC (fc->b->r);
+}
+
+void Layer::appendRects (search_buf *bmat, search_buf *bvia, int slot,
+			 int leaf, const TransformMat &m, int what,
+			 void *net, unsigned int attr)
+{
+  struct flat_cookie fc;
+
+  fc.leaf = leaf;
+  fc.what = what;
+  fc.net = net;
+  fc.attr = attr;
+
+  if (bmat) {
+    int pos = A_LEN (bmat->r);
+    fc.b = bmat;
+    fc.layer = slot;
+    _searchwindow (hint, NULL, &fc, append_flat);
+    m.applyRects (bmat->r + pos, bmat->r + pos, A_LEN (bmat->r) - pos);
+  }
+  if (bvia) {
+    int pos = A_LEN (bvia->r);
+    fc.b = bvia;
+    fc.layer = slot + 1;
+    _searchwindow (vhint, NULL, &fc, append_flat);
+    m.applyRects (bvia->r + pos, bvia->r + pos, A_LEN (bvia->r) - pos);
+  }
+}
+
+void Layer::_growAttrBox (unsigned int attr, const Rectangle &r)
+{
+  for (int i=0; i < A_LEN (_attrbox); i++) {
+    if (_attrbox[i].attr == attr) {
+      _attrbox[i].r = _attrbox[i].r ^ r;
+      return;
+    }
+  }
+  A_NEW (_attrbox, struct attr_extent);
+  A_NEXT (_attrbox).attr = attr;
+  A_NEXT (_attrbox).r = r;
+  A_INC (_attrbox);
+}
+
+Rectangle Layer::getAttrBBox (unsigned int attr)
+{
+  if (!_attrbox_valid) {
+    list_t *l = list_new ();
+    _searchwindow (hint, NULL, l, append_nonspacetile);
+    A_LEN (_attrbox) = 0;
+    while (!list_isempty (l)) {
+      Tile *t = (Tile *) list_delete_head (l);
+      Rectangle r;
+      r.setRectCoords (t->getllx(), t->getlly(), t->geturx(), t->getury());
+      _growAttrBox (t->getAttr(), r);
+    }
+    list_free (l);
+    _attrbox_valid = 1;
+  }
+  for (int i=0; i < A_LEN (_attrbox); i++) {
+    if (_attrbox[i].attr == attr) {
+      return _attrbox[i].r;
+    }
+  }
+  Rectangle r;
+  return r;
+}
+
+struct net_extent {
+  void *net;
+  Rectangle r;
+};
+
+static void net_extent_tile (void *cookie, Tile *t)
+{
+  struct net_extent *ne = (struct net_extent *) cookie;
+  if (!t->isSpace() && t->getNet () == ne->net) {
+    Rectangle r;
+    r.setRectCoords (t->getllx(), t->getlly(), t->geturx(), t->getury());
+    ne->r = ne->r ^ r;
+  }
+}
+
+Rectangle Layer::getNetBBox (void *net, int via)
+{
+  struct net_extent ne;
+
+  ne.net = net;
+  _searchwindow (hint, NULL, &ne, net_extent_tile);
+  if (via) {
+    _searchwindow (vhint, NULL, &ne, net_extent_tile);
+  }
+  return ne.r;
+}
 
 Tile *Layer::find (long llx, long lly)
 {
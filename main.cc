@@ -40,9 +40,11 @@ void usage (char *name)
   fprintf (stderr, " -o <name>: output files will be <name>.<extension> (default: out)\n");
   fprintf (stderr, " -s : emit spice netlist\n");
   fprintf (stderr, " -P : include PINS section in DEF file\n");
+  fprintf (stderr, " -D <file>: write the DEF file to <file> instead of <name>.def, streaming\n\tit forward-only so it can be a pipe/FIFO; use - for stdout\n");
   fprintf (stderr, " -a <mult>: use <mult> as the area multiplier for the DEF fie (default 1.4)\n");
   fprintf (stderr, " -r <ratio> : use this as the aspect ratio = x-size/y-size (default 1.0)\n");
   fprintf (stderr, " -c <cell>: Read in the <cell> ACT file as a starting point for cells,\n\toverwriting it with an updated version with any new cells\n");
+  fprintf (stderr, " -j <n>: use <n> threads to read .rect files and generate the DEF NETS section (default 1)\n");
   fprintf (stderr, " -S : share staticizers\n");
   //fprintf (stderr, " -A : report area\n");
   fprintf (stderr, " -R : generate report\n");
@@ -58,7 +60,9 @@ int main (int argc, char **argv)
   char *proc_name = NULL;
   char *outname = NULL;
   char *cellname = NULL;
+  char *defname = NULL;
   int do_pins = 0;
+  int def_threads = 1;
   int do_spice = 0;
   char buf[1024];
   FILE *fp;
@@ -85,7 +89,7 @@ int main (int argc, char **argv)
   }
 #endif
 
-  while ((ch = getopt (argc, argv, "c:p:o:sSPRa:r:")) != -1) {
+  while ((ch = getopt (argc, argv, "c:p:o:sSPRa:r:D:j:")) != -1) {
     switch (ch) {
     case 'S':
       share_staticizers = 1;
@@ -114,6 +118,20 @@ int main (int argc, char **argv)
       do_pins = 1;
       break;
 
+    case 'j':
+      def_threads = atoi (optarg);
+      if (def_threads < 1) {
+	def_threads = 1;
+      }
+      break;
+
+    case 'D':
+      if (defname) {
+	FREE (defname);
+      }
+      defname = Strdup (optarg);
+      break;
+
     case 'p':
       if (proc_name) {
 	FREE (proc_name);
@@ -155,6 +173,13 @@ int main (int argc, char **argv)
     outname = Strdup ("out");
   }
 
+  /* stdout carries the DEF, so everything else goes to stderr */
+  FILE *msg = stdout;
+  if (defname && strcmp (defname, "-") == 0) {
+    msg = stderr;
+    LayoutBlob::setRectInfo (stderr);
+  }
+
   /*--- read in and expand ACT file ---*/
   a = new Act (argv[optind]);
 
@@ -199,6 +224,12 @@ int main (int argc, char **argv)
     fclose (sp);
   }
 
+  if (def_threads > 1) {
+    lp->setParam ("rect_top", (void *)p);
+    lp->setParam ("rect_threads", def_threads);
+    lp->runcmd ("rect_prefetch");
+  }
+
   lp->run (p);
 
   ActNamespace *cell_ns = a->findNamespace ("cell");
@@ -222,17 +253,15 @@ int main (int argc, char **argv)
   }
   lp->setParam ("cell_file", (void *)fpcell);
 
-  /* emit lef and cell files */
-  lp->run_recursive (p, 1);
+  /* emit lef, cell, and rect files, and compute the max cell height
+     in a single pass */
+  lp->run_recursive (p, 6);
   
   fclose (fp);
   fclose (fpcell);
 
   lp->setParam ("cell_file", (void*)NULL);
   lp->setParam ("lef_file", (void*)NULL);
-
-  /* emit rect */
-  lp->run_recursive (p, 4);
   
   /* 
      preparation for DEF file generation: create flat netlist using
@@ -243,19 +272,40 @@ int main (int argc, char **argv)
   boolinfo->createNets (p);
   
   /* --- print out def file --- */
-  snprintf (buf, 1024, "%s.def", outname);
-  fp = fopen (buf, "w+");
-  if (!fp) {
-    fatal_error ("Could not open file `%s' for writing", buf);
+  if (defname) {
+    if (strcmp (defname, "-") == 0) {
+      fp = stdout;
+    }
+    else {
+      fp = fopen (defname, "w");
+    }
+    if (!fp) {
+      fatal_error ("Could not open file `%s' for writing", defname);
+    }
+    lp->setParam ("def_stream", 1);
+  }
+  else {
+    snprintf (buf, 1024, "%s.def", outname);
+    fp = fopen (buf, "w+");
+    if (!fp) {
+      fatal_error ("Could not open file `%s' for writing", buf);
+    }
+    lp->setParam ("def_stream", 0);
   }
   lp->setParam ("def_file", (void *)fp);
   lp->setParam ("do_pins", do_pins);
+  lp->setParam ("def_threads", def_threads);
   lp->setParam ("area_mult", area_multiplier);
   lp->setParam ("aspect_ratio", aspect_ratio);
 
   lp->run_recursive (p, 5);
 
-  fclose (fp);
+  if (fp == stdout) {
+    fflush (fp);
+  }
+  else {
+    fclose (fp);
+  }
   lp->setParam ("def_file", (void*)NULL);
 
   if (report) {
@@ -268,17 +318,22 @@ int main (int argc, char **argv)
     if (a > 1e4) {
       a /= 1e6;
       as /= 1e6;
-      printf ("Total Area: %.3g mm^2\n", a);
-      printf ("Total StdCell Area: %.3g mm^2 ", as);
+      fprintf (msg, "Total Area: %.3g mm^2\n", a);
+      fprintf (msg, "Total StdCell Area: %.3g mm^2 ", as);
     }
     else {
-      printf ("Total Area: %.3g um^2\n", a);
-      printf ("Total StdCell Area: %.3g um^2 ", as);
+      fprintf (msg, "Total Area: %.3g um^2\n", a);
+      fprintf (msg, "Total StdCell Area: %.3g um^2 ", as);
     }
     int stdcellht = lp->getIntParam ("cell_maxheight");
-    printf (" (%.2g%%) [height=%d, #tracks=%d]\n", 
-	    (as-a)/a*100.0, stdcellht,
-	    stdcellht/Technology::T->metal[0]->getPitch());
+    fprintf (msg, " (%.2g%%) [height=%d, #tracks=%d]\n", 
+	     (as-a)/a*100.0, stdcellht,
+	     stdcellht/Technology::T->metal[0]->getPitch());
+    if (lp->hasParam ("rect_written")) {
+      fprintf (msg, "Rect files: %d written, %d unchanged\n",
+	       lp->getIntParam ("rect_written"),
+	       lp->getIntParam ("rect_unchanged"));
+    }
 
     lp->run_recursive (p, 2);
   }
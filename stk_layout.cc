@@ -25,6 +25,15 @@
 #include <act/passes.h>
 #include <math.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include "stk_pass.h"
 #include "stk_layout.h"
 
@@ -255,6 +264,30 @@ void ActStackLayout::cacheConfig ()
     }
   }
 
+  _rect_cache = 0;
+  _rect_cachedir = NULL;
+  if (_rect_import) {
+    if (config_exists ("lefdef.rect_cache")) {
+      _rect_cache = config_get_int ("lefdef.rect_cache");
+      if (_rect_cache != 0 && _rect_cache != 1) {
+	fatal_error ("lefdef.rect_cache: must be 0 or 1");
+      }
+    }
+    if (config_exists ("lefdef.rect_cachedir")) {
+      _rect_cachedir = config_get_string ("lefdef.rect_cachedir");
+    }
+  }
+
+  if (config_exists ("lefdef.rect_compress")) {
+    _rect_compress = config_get_int ("lefdef.rect_compress");
+    if (_rect_compress != 0 && _rect_compress != 1) {
+      fatal_error ("lefdef.rect_compress: must be 0 or 1");
+    }
+  }
+  else {
+    _rect_compress = 0;
+  }
+
   if (config_exists ("lefdef.rect_outdir")) {
     _rect_outdir = config_get_string ("lefdef.rect_outdir");
   }
@@ -331,18 +364,26 @@ ActStackLayout::ActStackLayout (ActPass *ap)
   _total_stdcell_area = -1;
   _total_instances = -1;
   _maxht = -1;
+  _maxht_proc = NULL;
   _ymin = 0;
   _ymax = 0;
 
   cacheConfig ();
 
   wellplugs = NULL;
+  _weak_supplies = NULL;
   dummy_netlist = NULL;
 
   _lef_header = 0;
   _cell_header = 0;
   _fp = NULL;
   _fpcell = NULL;
+  _def_threads = 1;
+  _rect_written = 0;
+  _rect_unchanged = 0;
+  _rect_prefetch = NULL;
+  _rect_files = NULL;
+  _rect_cellfiles = NULL;
 }
 
 #define EDGE_FLAGS_LEFT 0x1
@@ -1102,7 +1143,27 @@ void *ActStackLayout::localop (ActPass *ap, Process *p, int mode)
     _fpcell = (FILE *)dp->getPtrParam ("cell_file");
   }
   if (mode == 0) {
-    return _createlocallayout (p);
+    LayoutBlob *b = _createlocallayout (p);
+    if (b && p) {
+      /* cell instances in .rect files refer to this by name */
+      char buf[10240];
+      a->msnprintfproc (buf, 10240, p);
+      LayoutBlob *old = LayoutBlob::findCell (buf);
+      if (old && old != b) {
+	/* instances already point to the registered blob, so update
+	   it in place */
+	old->incRef ();
+	old->replaceWith (b);
+	LayoutBlob::decRef (b);
+	b = old;
+	/* it is refreshed as a process from now on */
+	_forgetCellRect (buf);
+      }
+      else {
+	LayoutBlob::registerCell (buf, b);
+      }
+    }
+    return b;
   }
   else if (mode == 1) {
     emitLEFHeader (_fp);
@@ -1120,6 +1181,21 @@ void *ActStackLayout::localop (ActPass *ap, Process *p, int mode)
   else if (mode == 4) {
     _emitlocalRect (p);
   }
+  else if (mode == 6) {
+    /* fused LEF/cell + rect + maxheight */
+    emitLEFHeader (_fp);
+    emitWellHeader (_fpcell);
+    _emitlocalLEF (p);
+    _emitlocalRect (p);
+    _maxHeightlocal (p);
+  }
+  if (mode == 1 || mode == 4 || mode == 6) {
+    /* flattened geometry is only needed while this cell is emitted */
+    LayoutBlob *b = getLayout (p);
+    if (b) {
+      b->flattenFree ();
+    }
+  }
   return ap->getMap (p);
 }
 
@@ -1135,12 +1211,546 @@ void *layout_proc (ActPass *_ap, Process *p, int mode)
 
 void layout_free (ActPass *ap, void *v)
 {
-  LayoutBlob *b = (LayoutBlob *)v;
+  /* the pass map holds one reference to each process layout */
+  LayoutBlob::decRef ((LayoutBlob *)v);
+}
+
+void layout_done (ActPass *_ap)
+{
+  ActDynamicPass *ap = dynamic_cast<ActDynamicPass *> (_ap);
+  Assert (ap, "What?");
+  ActStackLayout *lp = (ActStackLayout *)ap->getPtrParam ("raw");
+  if (lp) {
+    delete lp;
+    ap->setParam ("raw", (void *)NULL);
+  }
+}
+
+/*
+ * Read the local .rect files for all the processes in the design on
+ * worker threads. Each file is parsed into its own Layout. Processes
+ * are read one level of the hierarchy at a time, leaves first, and
+ * each level is set up and registered serially before the next one
+ * is read, so cell lines find the registered blob for their type.
+ * The resulting blobs are picked up by _readlocalRect.
+ */
+struct rect_prefetch {
+  Process *p;
+  netlist_t *nl;
+  char *file;
+  int level;			// height in the instance hierarchy
+  LayoutBlob *b;
+  Rectangle bbox;
+};
+
+/*
+ * Collect the processes under p in post-order, and return the height
+ * of p (0 for a leaf)
+ */
+static int _collect_rect_procs (Process *p, std::map<Process *, int> *s,
+				list_t *l)
+{
+  std::map<Process *, int>::iterator it = s->find (p);
+  int level = 0;
+  int x;
+
+  if (it != s->end()) {
+    return it->second;
+  }
+  (*s)[p] = 0;
+
+  ActUniqProcInstiter i(p->CurScope());
+  for (i = i.begin(); i != i.end(); i++) {
+    ValueIdx *vx = (*i);
+    Process *instproc = dynamic_cast<Process *>(vx->t->BaseType ());
+    if (vx->t->arrayInfo()) {
+      Arraystep *as = vx->t->arrayInfo()->stepper();
+      while (!as->isend()) {
+	if (vx->isPrimary (as->index())) {
+	  x = _collect_rect_procs (as->curProc(), s, l);
+	  if (x + 1 > level) {
+	    level = x + 1;
+	  }
+	}
+	as->step();
+      }
+      delete as;
+    }
+    else {
+      x = _collect_rect_procs (instproc, s, l);
+      if (x + 1 > level) {
+	level = x + 1;
+      }
+    }
+  }
+  (*s)[p] = level;
+  list_append (l, p);
+  return level;
+}
+
+static bool _empty_stacks (list_t *l);
+
+void ActStackLayout::prefetchRect (Process *top, int nthreads)
+{
+  std::map<Process *, int> seen;
+  list_t *procs;
+  listitem_t *li;
+  int maxlevel = 0;
+  A_DECL (struct rect_prefetch *, jobs);
+
+  if (_rect_import == 0 || !top) {
+    return;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+
+  /* the .rect files are only used for processes with stacks, and
+     setting up the blobs needs them */
+  if (!stk->completed ()) {
+    stk->run (top);
+  }
+
+  procs = list_new ();
+  _collect_rect_procs (top, &seen, procs);
+
+  /* resolve the file names up front; the path search is not reentrant */
+  A_INIT (jobs);
+  for (li = list_first (procs); li; li = list_next (li)) {
+    Process *p = (Process *) list_value (li);
+    netlist_t *n;
+    char cname[10240];
+    char *tmpname;
+    int len;
+
+    if (p->isBlackBox() || p->isLowLevelBlackBox()) {
+      continue;
+    }
+    if (_rect_prefetch && phash_lookup (_rect_prefetch, p)) {
+      continue;
+    }
+    n = nl->getNL (p);
+    if (!n) {
+      continue;
+    }
+    if (_empty_stacks ((list_t *) stk->getMap (p))) {
+      /* mode 0 does not read a .rect file for this */
+      continue;
+    }
+    a->msnprintfproc (cname, 10240, p);
+    len = strlen (cname);
+    snprintf (cname + len, 10240 - len, ".rect");
+
+    tmpname = _rectInpath (cname);
+
+    struct rect_prefetch *rp = new rect_prefetch;
+    rp->p = p;
+    rp->nl = n;
+    rp->file = tmpname ? tmpname : Strdup (cname);
+    rp->level = seen[p];
+    rp->b = NULL;
+    if (rp->level > maxlevel) {
+      maxlevel = rp->level;
+    }
+    A_NEW (jobs, struct rect_prefetch *);
+    A_NEXT (jobs) = rp;
+    A_INC (jobs);
+  }
+  list_free (procs);
+
+  if (A_LEN (jobs) == 0) {
+    A_FREE (jobs);
+    return;
+  }
+
+  /* the first Layout initializes shared technology state */
+  Layout::Init ();
+
+  if (!_rect_prefetch) {
+    _rect_prefetch = phash_new (8);
+  }
+
+  int *wave;
+  MALLOC (wave, int, A_LEN (jobs));
+
+  for (int level=0; level <= maxlevel; level++) {
+    int nwave = 0;
+    for (int j=0; j < A_LEN (jobs); j++) {
+      if (jobs[j]->level == level) {
+	wave[nwave++] = j;
+      }
+    }
+    if (nwave == 0) {
+      continue;
+    }
+
+    std::atomic<int> next (0);
+    int nw = nthreads;
+    if (nw > nwave) {
+      nw = nwave;
+    }
+    std::thread *workers = new std::thread[nw];
+    for (int k=0; k < nw; k++) {
+      workers[k] = std::thread ([&] () {
+	  int j;
+	  while ((j = next++) < nwave) {
+	    struct rect_prefetch *rp = jobs[wave[j]];
+	    rp->b = LayoutBlob::ReadRect (rp->file, rp->nl, rp->bbox,
+					  _rect_import, _rect_cache,
+					  _rect_cachedir);
+	  }
+	});
+    }
+    for (int k=0; k < nw; k++) {
+      workers[k].join ();
+    }
+    delete [] workers;
+
+    /* set up and register this level, in hierarchy order */
+    for (int j=0; j < nwave; j++) {
+      struct rect_prefetch *rp = jobs[wave[j]];
+      char buf[10240], cname[10240];
+
+      if (!rp->b) {
+	FREE (rp->file);
+	delete rp;
+	continue;
+      }
+      a->msnprintfproc (buf, 10240, rp->p);
+      snprintf (cname, 10240, "%s.rect", buf);
+      rp->b = _finishlocalRect (rp->p, cname, rp->b, rp->bbox);
+      LayoutBlob::registerCell (buf, rp->b);
+
+      phash_bucket_t *b = phash_add (_rect_prefetch, rp->p);
+      b->v = rp;
+    }
+  }
+  FREE (wave);
+  A_FREE (jobs);
+  _recordCellRects ();
+}
+
+
+/*
+ * Find a .rect file on the input path, falling back to a compressed
+ * version of it. Returns NULL if neither was found there.
+ */
+char *ActStackLayout::_rectInpath (const char *cname)
+{
+  char *tmpname;
+  char gzname[10240];
+
+  if (!_rect_inpath) {
+    return NULL;
+  }
+  tmpname = path_open (_rect_inpath, cname, NULL);
+  if (!tmpname) {
+    snprintf (gzname, 10240, "%s.gz", cname);
+    tmpname = path_open (_rect_inpath, gzname, NULL);
+  }
+  return tmpname;
+}
+
+/*
+ * Remember which .rect file was imported for a process or a cell, so
+ * that refreshRect can tell if it changed
+ */
+struct rect_file_info {
+  char *file;
+  off_t size;
+  time_t mtime;
+  unsigned long hash;
+};
+
+static void _rect_file_set (struct rect_file_info *ri, const char *file)
+{
+  struct stat st;
+
+  if (stat (file, &st) != 0) {
+    /* ReadRect falls back to the compressed file */
+    char gzname[10240];
+    snprintf (gzname, 10240, "%s.gz", file);
+    ri->file = Strdup (gzname);
+  }
+  else {
+    ri->file = Strdup (file);
+  }
+  if (stat (ri->file, &st) == 0) {
+    ri->size = st.st_size;
+    ri->mtime = st.st_mtime;
+  }
+  else {
+    ri->size = -1;
+    ri->mtime = 0;
+  }
+  if (!LayoutBlob::RectHash (ri->file, &ri->hash)) {
+    ri->hash = 0;
+  }
+}
+
+/*
+ * Returns 1 if the file has changed since it was recorded, 0 if not,
+ * and -1 if it is missing
+ */
+static int _rect_file_changed (struct rect_file_info *ri)
+{
+  struct stat st;
+  unsigned long hash;
+
+  if (stat (ri->file, &st) != 0) {
+    return -1;
+  }
+  if (st.st_size == ri->size && st.st_mtime == ri->mtime) {
+    return 0;
+  }
+  if (st.st_size == ri->size && LayoutBlob::RectHash (ri->file, &hash)
+      && hash == ri->hash) {
+    /* touched, but not modified */
+    ri->mtime = st.st_mtime;
+    return 0;
+  }
+  return 1;
+}
+
+void ActStackLayout::_recordRect (Process *p, const char *file)
+{
+  struct rect_file_info *ri;
+  phash_bucket_t *b;
+
+  if (!_rect_files) {
+    _rect_files = phash_new (8);
+  }
+  b = phash_lookup (_rect_files, p);
   if (b) {
-    delete b;
+    ri = (struct rect_file_info *) b->v;
+    FREE (ri->file);
+  }
+  else {
+    b = phash_add (_rect_files, p);
+    NEW (ri, struct rect_file_info);
+    b->v = ri;
+  }
+  _rect_file_set (ri, file);
+}
+
+/*
+ * Record the .rect files of cells that were read in by cell lines
+ * since the last call
+ */
+void ActStackLayout::_recordCellRects ()
+{
+  hash_bucket_t *hb, *b;
+  hash_iter_t it;
+
+  if (!LayoutBlob::cellToFile) {
+    return;
+  }
+  if (!_rect_cellfiles) {
+    _rect_cellfiles = hash_new (4);
+  }
+  hash_iter_init (LayoutBlob::cellToFile, &it);
+  while ((hb = hash_iter_next (LayoutBlob::cellToFile, &it))) {
+    if (hash_lookup (_rect_cellfiles, hb->key)) {
+      continue;
+    }
+    struct rect_file_info *ri;
+    NEW (ri, struct rect_file_info);
+    _rect_file_set (ri, (char *) hb->v);
+    b = hash_add (_rect_cellfiles, hb->key);
+    b->v = ri;
+  }
+}
+
+/*
+ * Stop tracking the .rect file of a cell
+ */
+void ActStackLayout::_forgetCellRect (const char *name)
+{
+  hash_bucket_t *hb;
+
+  LayoutBlob::setCellFile (name, NULL);
+  if (_rect_cellfiles && (hb = hash_lookup (_rect_cellfiles, name))) {
+    struct rect_file_info *ri = (struct rect_file_info *) hb->v;
+    FREE (ri->file);
+    FREE (ri);
+    hash_delete (_rect_cellfiles, name);
   }
 }
 
+/*
+ * Re-read the imported .rect files that have changed since they were
+ * read, for processes as well as for cells that were only read in by
+ * cell lines. Each layout is updated in place, so anything holding on
+ * to it (the pass map, subcell instances) sees the new geometry. The
+ * boxes and alignment markers cached by the blobs that contain them
+ * are then recomputed. Returns the number of files re-read.
+ */
+int ActStackLayout::refreshRect ()
+{
+  phash_iter_t it;
+  phash_bucket_t *b;
+  int count = 0;
+
+  if (_rect_import == 0) {
+    return 0;
+  }
+  _recordCellRects ();
+
+  if (_rect_files) {
+    phash_iter_init (_rect_files, &it);
+  }
+  while (_rect_files && (b = phash_iter_next (_rect_files, &it))) {
+    Process *p = (Process *) b->key;
+    struct rect_file_info *ri = (struct rect_file_info *) b->v;
+    int chg = _rect_file_changed (ri);
+
+    if (chg < 0) {
+      warning ("%s: could not find rect file `%s'; layout not updated",
+	       p->getName(), ri->file);
+      continue;
+    }
+    if (chg == 0) {
+      continue;
+    }
+
+    LayoutBlob *old = getLayout (p);
+    LayoutBlob *nb = _readlocalRect (p);
+    if (!nb) {
+      warning ("%s: could not re-read rect file `%s'; layout not updated",
+	       p->getName(), ri->file);
+      continue;
+    }
+    if (!old) {
+      warning ("%s: no layout to update", p->getName());
+      LayoutBlob::decRef (nb);
+      continue;
+    }
+    old->replaceWith (nb);
+    /* nb now holds the old geometry */
+    LayoutBlob::decRef (nb);
+    count++;
+  }
+
+  if (_rect_cellfiles) {
+    hash_bucket_t *hb;
+    hash_iter_t hit;
+
+    hash_iter_init (_rect_cellfiles, &hit);
+    while ((hb = hash_iter_next (_rect_cellfiles, &hit))) {
+      struct rect_file_info *ri = (struct rect_file_info *) hb->v;
+      int chg = _rect_file_changed (ri);
+      Rectangle cbox;
+
+      if (chg < 0) {
+	warning ("cell %s: could not find rect file `%s'; layout not updated",
+		 hb->key, ri->file);
+	continue;
+      }
+      if (chg == 0) {
+	continue;
+      }
+      LayoutBlob *old = LayoutBlob::findCell (hb->key);
+      LayoutBlob *nb = LayoutBlob::ReadRect (ri->file, NULL, cbox,
+					     _rect_import, _rect_cache,
+					     _rect_cachedir);
+      if (!nb || !old) {
+	warning ("cell %s: could not re-read rect file `%s'; layout not updated",
+		 hb->key, ri->file);
+	LayoutBlob::decRef (nb);
+	continue;
+      }
+      nb->markRead ();
+      old->replaceWith (nb);
+      LayoutBlob::decRef (nb);
+      char *file = Strdup (ri->file);
+      FREE (ri->file);
+      _rect_file_set (ri, file);
+      FREE (file);
+      count++;
+    }
+  }
+
+  if (count > 0) {
+    LayoutBlob::refreshCells ();
+
+    /* cell heights may have changed */
+    _ymin = 0;
+    _ymax = 0;
+    _maxht = -1;
+    _maxht_proc = NULL;
+  }
+  return count;
+}
+
+/*
+ * The welltap and shared staticizer cells belong to the pass
+ */
+void ActStackLayout::_freeCells ()
+{
+  if (wellplugs) {
+    int ntaps = config_get_table_size ("act.dev_flavors");
+    for (int i=0; i < ntaps; i++) {
+      LayoutBlob::decRef (wellplugs[i]);
+    }
+    FREE (wellplugs);
+    wellplugs = NULL;
+  }
+  if (_weak_supplies) {
+    listitem_t *li;
+    for (li = list_first (_weak_supplies); li; li = list_next (li)) {
+      LayoutBlob::decRef ((LayoutBlob *) list_value (li));
+    }
+    list_free (_weak_supplies);
+    _weak_supplies = NULL;
+  }
+}
+
+ActStackLayout::~ActStackLayout ()
+{
+  phash_bucket_t *b;
+  phash_iter_t it;
+
+  _freeCells ();
+
+  if (_rect_prefetch) {
+    /* .rect files that were read in but never used */
+    phash_iter_init (_rect_prefetch, &it);
+    while ((b = phash_iter_next (_rect_prefetch, &it))) {
+      struct rect_prefetch *rp = (struct rect_prefetch *) b->v;
+      LayoutBlob::decRef (rp->b);
+      FREE (rp->file);
+      delete rp;
+    }
+    phash_free (_rect_prefetch);
+    _rect_prefetch = NULL;
+  }
+  if (_rect_files) {
+    phash_iter_init (_rect_files, &it);
+    while ((b = phash_iter_next (_rect_files, &it))) {
+      struct rect_file_info *ri = (struct rect_file_info *) b->v;
+      FREE (ri->file);
+      FREE (ri);
+    }
+    phash_free (_rect_files);
+    _rect_files = NULL;
+  }
+  if (_rect_cellfiles) {
+    hash_bucket_t *hb;
+    hash_iter_t hit;
+    hash_iter_init (_rect_cellfiles, &hit);
+    while ((hb = hash_iter_next (_rect_cellfiles, &hit))) {
+      struct rect_file_info *ri = (struct rect_file_info *) hb->v;
+      FREE (ri->file);
+      FREE (ri);
+    }
+    hash_free (_rect_cellfiles);
+    _rect_cellfiles = NULL;
+  }
+
+  /* process layouts are registered as cells */
+  LayoutBlob::clearCells ();
+}
+
 LayoutBlob *ActStackLayout::_readlocalRect (Process *p)
 {
   char cname[10240];
@@ -1159,34 +1769,59 @@ LayoutBlob *ActStackLayout::_readlocalRect (Process *p)
   len = strlen (cname);
   snprintf (cname + len, 10240 - len, ".rect");
 
-  char *tmpname;
-  if (_rect_inpath) {
-    tmpname = path_open (_rect_inpath, cname, NULL);
+  Rectangle file_bbox;
+  LayoutBlob *b;
+  phash_bucket_t *pb;
+
+  if (_rect_prefetch && p && (pb = phash_lookup (_rect_prefetch, p))) {
+    /* already read in and set up by prefetchRect */
+    struct rect_prefetch *rp = (struct rect_prefetch *) pb->v;
+    b = rp->b;
+    if (b) {
+      _recordRect (p, rp->file);
+    }
+    FREE (rp->file);
+    delete rp;
+    phash_delete (_rect_prefetch, p);
+    return b;
   }
   else {
-    tmpname = NULL;
-  }
+    char *tmpname;
+    tmpname = _rectInpath (cname);
     
 #if 0
-  printf (" === processing %s\n", cname);
+    printf (" === processing %s\n", cname);
 #endif
 
-  Rectangle file_bbox;
-  LayoutBlob *b = LayoutBlob::ReadRect (tmpname ? tmpname : cname,
-					nl->getNL (p), file_bbox,
-					_rect_import);
-  if (tmpname) {
-    FREE (tmpname);
+    b = LayoutBlob::ReadRect (tmpname ? tmpname : cname,
+			      nl->getNL (p), file_bbox,
+			      _rect_import, _rect_cache, _rect_cachedir);
+    if (b && p) {
+      _recordRect (p, tmpname ? tmpname : cname);
+    }
+    if (tmpname) {
+      FREE (tmpname);
+    }
+    _recordCellRects ();
   }
 
   if (!b) {
     return NULL;
   }
+  return _finishlocalRect (p, cname, b, file_bbox);
+}
 
+/*
+ * Set up the blob b read in from the .rect file cname for process p:
+ * align the diffusion to y=0 and add the LEF boundary
+ */
+LayoutBlob *ActStackLayout::_finishlocalRect (Process *p, const char *cname,
+					      LayoutBlob *b,
+					      Rectangle &file_bbox)
+{
   /* now shift all the tiles to line up 0,0 in the middle of the
      diffusion section */
   DiffMat *d = NULL;
-  list_t *tiles = NULL;
   int type, flavor;
   long ymin, ymax;
   long updiff, dndiff;
@@ -1194,19 +1829,15 @@ LayoutBlob *ActStackLayout::_readlocalRect (Process *p)
   
   for (int i=0; i < Technology::T->num_devs; i++) {
     for (int j=0; j < 2; j++) {
-      tiles = b->search (TILE_FLGS_TO_ATTR(i,j,DIFF_OFFSET));
-      if (list_isempty (tiles)) {
-	list_free (tiles);
-      }
-      else {
+      Rectangle dr = b->searchBBox (TILE_FLGS_TO_ATTR(i,j,DIFF_OFFSET));
+      if (!dr.empty()) {
 	/* done! */
-	long xmin, xmax;
 	d = Technology::T->diff[j][i];
 	type = j;
 	flavor = i;
-	LayoutBlob::searchBBox (tiles, &xmin, &ymin, &xmax, &ymax);
 	/* calculate ymin, ymax */
-	LayoutBlob::searchFree (tiles);
+	ymin = dr.lly();
+	ymax = dr.ury() + 1;
 	set_diff++;
 	if (type == EDGE_PFET) {
 	  updiff = ymin;
@@ -1698,17 +2329,13 @@ LayoutBlob *ActStackLayout::_readwelltap (int flavor)
 
   snprintf (cname, 128, "welltap_%s.rect", act_dev_value_to_string (flavor));
 
-  if (_rect_inpath) {
-    tmpname = path_open (_rect_inpath, cname, NULL);
-  }
-  else {
-    tmpname = NULL;
-  }
+  tmpname = _rectInpath (cname);
 
   Rectangle file_bbox;
   LayoutBlob *b = LayoutBlob::ReadRect (tmpname ? tmpname : cname,
 					dummy_netlist, file_bbox,
-					_rect_import);
+					_rect_import, _rect_cache,
+					_rect_cachedir);
   if (tmpname) {
     FREE (tmpname);
   }
@@ -1719,7 +2346,6 @@ LayoutBlob *ActStackLayout::_readwelltap (int flavor)
   /* now shift all the tiles to line up 0,0 in the middle of the
      ppdiff/nndiff diffusion section */
   DiffMat *d = NULL;
-  list_t *tiles = NULL;
   int type;
   long ymin, ymax;
   long updiff, dndiff;
@@ -1728,21 +2354,16 @@ LayoutBlob *ActStackLayout::_readwelltap (int flavor)
   updiff = 0;
   dndiff = 0;
 
-  
   for (int j=0; j < 2; j++) {
-    tiles = b->search (TILE_FLGS_TO_ATTR(flavor,j,WDIFF_OFFSET));
-    if (list_isempty (tiles)) {
-      list_free (tiles);
-    }
-    else {
+    Rectangle dr = b->searchBBox (TILE_FLGS_TO_ATTR(flavor,j,WDIFF_OFFSET));
+    if (!dr.empty()) {
       /* done! */
-      long xmin, xmax;
       d = Technology::T->welldiff[j][flavor];
       if (d) {
 	type = j;
-	LayoutBlob::searchBBox (tiles, &xmin, &ymin, &xmax, &ymax);
 	/* calculate ymin, ymax */
-	LayoutBlob::searchFree (tiles);
+	ymin = dr.lly();
+	ymax = dr.ury() + 1;
 	set_diff++;
 	if (type == EDGE_PFET) {
 	  updiff = ymin;
@@ -1941,6 +2562,8 @@ void ActStackLayout::_emitwelltaprect (int flavor)
   strcat (name, ".rect");
 
   FILE *tfp;
+  char *rbuf;
+  size_t rlen;
 
   const char *outdir;
   if (b->getRead()) {
@@ -1950,22 +2573,9 @@ void ActStackLayout::_emitwelltaprect (int flavor)
     outdir = _rect_outinitdir;
   }
   
-  if (outdir) {
-    char *outname;
-    int sz = strlen (name) + strlen (outdir) + 2;
-    MALLOC (outname, char, sz);
-    snprintf (outname, sz, "%s/%s", outdir, name);
-    tfp = fopen (outname, "w");
-    if (!tfp) {
-      fatal_error ("Could not open file `%s' for writing", outname);
-    }
-    FREE (outname);
-  }
-  else {
-    tfp = fopen (name, "w");
-    if (!tfp) {
-      fatal_error ("Could not open file `%s' for writing", name);
-    }
+  tfp = open_memstream (&rbuf, &rlen);
+  if (!tfp) {
+    fatal_error ("Could not create buffer for `%s'", name);
   }
   b->PrintRect (tfp, &mat);
 
@@ -1981,6 +2591,165 @@ void ActStackLayout::_emitwelltaprect (int flavor)
     }
   }
   fclose (tfp);
+  _writeRect (outdir, name, rbuf, rlen);
+  free (rbuf);
+}
+
+
+/*
+  Write out a .rect file, but only if the contents are different from
+  the file that is already there. This keeps timestamps unchanged for
+  cells whose layout did not change.
+*/
+void ActStackLayout::_writeRect (const char *outdir, const char *name,
+				 const char *buf, size_t len)
+{
+  char *outname;
+  int sz;
+
+  sz = strlen (name) + (outdir ? strlen (outdir) + 1 : 0) + 4;
+  MALLOC (outname, char, sz);
+  snprintf (outname, sz, "%s%s%s%s", outdir ? outdir : "", outdir ? "/" : "",
+	    name, _rect_compress ? ".gz" : "");
+
+  if (_rect_compress) {
+    _writeRectgz (outname, buf, len);
+  }
+  else {
+    _writeRectplain (outname, buf, len);
+  }
+  FREE (outname);
+
+  /* lookups prefer X.rect over X.rect.gz, so remove the form that was
+     not written to keep a stale copy from being read back. Only done
+     once outname is in place, so a failed write leaves the old copy. */
+  {
+    char *other;
+    MALLOC (other, char, sz);
+    snprintf (other, sz, "%s%s%s%s", outdir ? outdir : "", outdir ? "/" : "",
+	      name, _rect_compress ? "" : ".gz");
+    if (unlink (other) != 0 && errno != ENOENT) {
+      warning ("Could not remove stale file `%s'", other);
+    }
+    FREE (other);
+  }
+}
+
+/*
+ * Same as _writeRect, but for uncompressed .rect files
+ */
+void ActStackLayout::_writeRectplain (const char *outname,
+				      const char *buf, size_t len)
+{
+  FILE *fp;
+
+  fp = fopen (outname, "r");
+  if (fp) {
+    char tmp[10240];
+    size_t pos = 0;
+    size_t n;
+    int same = 1;
+
+    while (same && (n = fread (tmp, 1, 10240, fp)) > 0) {
+      if (pos + n > len || memcmp (tmp, buf + pos, n) != 0) {
+	same = 0;
+      }
+      pos += n;
+    }
+    fclose (fp);
+    if (same && pos == len) {
+      _rect_unchanged++;
+      return;
+    }
+  }
+
+  /* write a temporary file and move it into place, so an interrupted
+     run does not leave a truncated .rect file behind */
+  char *tmpname = _rectTmpname (outname);
+  fp = fopen (tmpname, "w");
+  if (!fp) {
+    fatal_error ("Could not open file `%s' for writing", tmpname);
+  }
+  if (len > 0 && fwrite (buf, 1, len, fp) != len) {
+    fclose (fp);
+    unlink (tmpname);
+    fatal_error ("Error writing file `%s'", tmpname);
+  }
+  if (fclose (fp) != 0) {
+    unlink (tmpname);
+    fatal_error ("Error writing file `%s'", tmpname);
+  }
+  if (rename (tmpname, outname) != 0) {
+    unlink (tmpname);
+    fatal_error ("Could not rename `%s' to `%s'", tmpname, outname);
+  }
+  FREE (tmpname);
+  _rect_written++;
+}
+
+/* name of the temporary file used to write outname */
+char *ActStackLayout::_rectTmpname (const char *outname)
+{
+  char *tmpname;
+  int sz = strlen (outname) + 5;
+  MALLOC (tmpname, char, sz);
+  snprintf (tmpname, sz, "%s.tmp", outname);
+  return tmpname;
+}
+
+/*
+ * Same as _writeRect, but for compressed .rect files
+ */
+void ActStackLayout::_writeRectgz (const char *outname,
+				   const char *buf, size_t len)
+{
+  gzFile gz;
+
+  gz = gzopen (outname, "rb");
+  if (gz) {
+    char tmp[10240];
+    size_t pos = 0;
+    int n;
+    int same = 1;
+
+    while (same && (n = gzread (gz, tmp, 10240)) > 0) {
+      if (pos + n > len || memcmp (tmp, buf + pos, n) != 0) {
+	same = 0;
+      }
+      pos += n;
+    }
+    gzclose (gz);
+    if (same && n == 0 && pos == len) {
+      _rect_unchanged++;
+      return;
+    }
+  }
+
+  char *tmpname = _rectTmpname (outname);
+  gz = gzopen (tmpname, "wb");
+  if (!gz) {
+    fatal_error ("Could not open file `%s' for writing", tmpname);
+  }
+  while (len > 0) {
+    unsigned int amt = (len > (1U << 30) ? (1U << 30) : len);
+    if (gzwrite (gz, buf, amt) != (int)amt) {
+      gzclose (gz);
+      unlink (tmpname);
+      fatal_error ("Error writing file `%s'", tmpname);
+    }
+    buf += amt;
+    len -= amt;
+  }
+  if (gzclose (gz) != Z_OK) {
+    unlink (tmpname);
+    fatal_error ("Error writing file `%s'", tmpname);
+  }
+  if (rename (tmpname, outname) != 0) {
+    unlink (tmpname);
+    fatal_error ("Could not rename `%s' to `%s'", tmpname, outname);
+  }
+  FREE (tmpname);
+  _rect_written++;
 }
 
 void layout_run (ActPass *_ap, Process *p)
@@ -2003,6 +2772,9 @@ void ActStackLayout::run_post (Process *top)
     fatal_error ("Layout generation: could not find both power supplies for substrate contacts!");
   }
 
+  /* discard cells from a previous run */
+  _freeCells ();
+
   /* create welltap cells */
   int ntaps = config_get_table_size ("act.dev_flavors");
   MALLOC (wellplugs, LayoutBlob *, ntaps);
@@ -2011,7 +2783,6 @@ void ActStackLayout::run_post (Process *top)
   }
 
   /* create any shared staticizer cells */
-  _weak_supplies = NULL;
   list_t *l = nl->getSharedStatTypes ();
   if (l && !list_isempty (l)) {
     _weak_supplies = list_new ();
@@ -2063,22 +2834,11 @@ void ActStackLayout::_emitlocalRect (Process *p)
     outdir = _rect_outinitdir;
   }
 
-  if (outdir) {
-    char *outname;
-    int sz = strlen (cname) + strlen (outdir) + 2;
-    MALLOC (outname, char, sz);
-    snprintf (outname, sz, "%s/%s", outdir, cname);
-    fp = fopen (outname, "w");
-    if (!fp) {
-      fatal_error ("Could not open file `%s' for writing", outname);
-    }
-    FREE (outname);
-  }
-  else {
-    fp = fopen (cname, "w");
-    if (!fp) {
-      fatal_error ("Could not open file `%s' for writing", cname);
-    }
+  char *rbuf;
+  size_t rlen;
+  fp = open_memstream (&rbuf, &rlen);
+  if (!fp) {
+    fatal_error ("Could not create buffer for `%s'", cname);
   }
   blob->PrintRect (fp, &mat);
 
@@ -2098,6 +2858,8 @@ void ActStackLayout::_emitlocalRect (Process *p)
   }
   
   fclose (fp);
+  _writeRect (outdir, cname, rbuf, rlen);
+  free (rbuf);
 }
 
 static void emit_header (FILE *fp, const char *name, const char *lefclass,
@@ -2129,42 +2891,82 @@ static void emit_footer (FILE *fp, const char *name)
   fprintf (fp, "END %s\n\n", name);
 }
 
-static int emit_layer_rects (FILE *fp, list_t *tiles, node_t **io = NULL,
-			      int num_io = 0)
+/*
+  Emit the metal and via rectangles of the flattened layout f,
+  transformed by m. If net is non-NULL, only rectangles on that net
+  are emitted; otherwise all metal (but not via) rectangles are
+  emitted as obstructions, skipping the nets in io. Rectangles are
+  grouped by leaf and then by layer, in search order.
+*/
+static int emit_layer_rects (FILE *fp, const flat_layout *f,
+			     TransformMat &m, node_t *net,
+			     node_t **io = NULL, int num_io = 0)
 {
   double scale = Technology::T->scale/1000.0;
-  listitem_t *tli;
   int emit_obs = 0;
+  int *pos;
+  struct flat_rect *xr = NULL;	// transformed rectangles for one run
+  int xrmax = 0;
 
-  for (tli = list_first (tiles); tli; tli = list_next (tli)) {
-    struct tile_listentry *tle = (struct tile_listentry *) list_value (tli);
-    listitem_t *xi;
+  MALLOC (pos, int, f->nlayers);
+  for (int i=0; i < f->nlayers; i++) {
+    pos[i] = 0;
+  }
+
+  for (int leaf=0; leaf < f->nleaves; leaf++) {
     Layer *lprev = NULL;
 
-    for (xi = list_first (tle->tiles); xi; xi = list_next (xi)) {
-      Layer *lname = (Layer *) list_value (xi);
-      xi = list_next (xi);
-      Assert (xi, "Hmm");
+    for (int i=0; i < f->nlayers; i++) {
+      const flat_layer *fl = &f->layers[i];
+      int start = pos[i];
+      int end = start;
+      int present = 0;
+
+      while (end < A_LEN (fl->b.r) && fl->b.r[end].leaf == leaf) {
+	if (net ? (fl->b.r[end].net == net) : 1) {
+	  present = 1;
+	}
+	end++;
+      }
+      pos[i] = end;
 
-      if (!lname->isMetal()) {
+      if (!present || !fl->l->isMetal()) {
+	continue;
+      }
+      if (!net && (i % 2) == 0) {
+	/* vias are not obstructions */
 	continue;
       }
 
-      list_t *actual_tiles = (list_t *) list_value (xi);
-      listitem_t *ti;
+      Layer *lname = fl->l;
       int first = 1;
+
+      if (end - start > xrmax) {
+	xrmax = end - start;
+	if (xr) {
+	  REALLOC (xr, struct flat_rect, xrmax);
+	}
+	else {
+	  MALLOC (xr, struct flat_rect, xrmax);
+	}
+      }
+      m.applyRects (fl->b.r + start, xr, end - start);
       
-      for (ti = list_first (actual_tiles); ti; ti = list_next (ti)) {
-	long tllx, tlly, turx, tury;
-	Tile *tmp = (Tile *) list_value (ti);
-
-	if (tmp->getNet()) {
-	  int k;
-	  for (k=0; k < num_io; k++) {
-	    if (tmp->getNet() == io[k])
+      for (int k=start; k < end; k++) {
+	const struct flat_rect *r = &xr[k - start];
+
+	if (net) {
+	  if (r->net != net) {
+	    continue;
+	  }
+	}
+	else if (r->net) {
+	  int j;
+	  for (j=0; j < num_io; j++) {
+	    if (r->net == io[j])
 	      break;
 	  }
-	  if (k != num_io) {
+	  if (j != num_io) {
 	    /* skip! */
 	    continue;
 	  }
@@ -2184,80 +2986,39 @@ static int emit_layer_rects (FILE *fp, list_t *tiles, node_t **io = NULL,
 	}
 	first = 0;
 	
-	tle->m.apply (tmp->getllx(), tmp->getlly(), &tllx, &tlly);
-	tle->m.apply (tmp->geturx(), tmp->getury(), &turx, &tury);
-
-	if (tllx > turx) {
-	  long x = tllx;
-	  tllx = turx;
-	  turx = x;
-	}
-	  
-	if (tlly > tury) {
-	  long x = tlly;
-	  tlly = tury;
-	  tury = x;
-	}
-	
 	fprintf (fp, "        RECT %.6f %.6f %.6f %.6f ;\n",
-		 scale*tllx, scale*tlly, scale*(1+turx), scale*(1+tury));
+		 scale*r->llx, scale*r->lly, scale*(1+r->urx), scale*(1+r->ury));
       }
       lprev = lname;
     }
   }
+  FREE (pos);
+  if (xr) {
+    FREE (xr);
+  }
   return emit_obs;
 }
 
-static void emit_antenna_area (FILE *fp, list_t *tiles)
+static void emit_antenna_area (FILE *fp, const flat_layout *f, node_t *net)
 {
   double scale = Technology::T->scale/1000.0;
-  listitem_t *tli;
   double ant_area = 0.0;
   double ant_diffarea = 0.0;
 
-  for (tli = list_first (tiles); tli; tli = list_next (tli)) {
-    struct tile_listentry *tle = (struct tile_listentry *) list_value (tli);
-    listitem_t *xi;
-
-    for (xi = list_first (tle->tiles); xi; xi = list_next (xi)) {
-      Layer *lname = (Layer *) list_value (xi);
-      xi = list_next (xi);
-      Assert (xi, "Hmm");
-
-      if (lname->isMetal()) {
-	continue;
-      }
-
-      list_t *actual_tiles = (list_t *) list_value (xi);
-      listitem_t *ti;
-      int first = 1;
-      
-      for (ti = list_first (actual_tiles); ti; ti = list_next (ti)) {
-	long tllx, tlly, turx, tury;
-	Tile *tmp = (Tile *) list_value (ti);
+  /* only the base layer has fets and diffusion */
+  const flat_layer *fl = &f->layers[0];
 
-	tle->m.apply (tmp->getllx(), tmp->getlly(), &tllx, &tlly);
-	tle->m.apply (tmp->geturx(), tmp->getury(), &turx, &tury);
-	
-	if (tllx > turx) {
-	  long x = tllx;
-	  tllx = turx;
-	  turx = x;
-	}
+  for (int k=0; k < A_LEN (fl->b.r); k++) {
+    const struct flat_rect *r = &fl->b.r[k];
 
-	if (tlly > tury) {
-	  long x = tlly;
-	  tlly = tury;
-	  tury = x;
-	}
-	
-	if (tmp->isFet()) {
-	  ant_area += (turx-tllx+1)*scale*(tury-tlly+1)*scale;
-	}
-	else if (tmp->isDiff()) {
-	  ant_diffarea += (turx-tllx+1)*scale*(tury-tlly+1)*scale;
-	}
-      }
+    if (r->net != net) {
+      continue;
+    }
+    if (r->fet) {
+      ant_area += (r->urx-r->llx+1)*scale*(r->ury-r->lly+1)*scale;
+    }
+    else if (r->diff) {
+      ant_diffarea += (r->urx-r->llx+1)*scale*(r->ury-r->lly+1)*scale;
     }
   }
   if (ant_area > 0) {
@@ -2290,15 +3051,13 @@ static void emit_one_pin (Act *a, FILE *fp, const char *name, int isinput,
   /* -- find all pins of this name! -- */
   TransformMat mat;
   mat.translate (-bloatbox.llx(), -bloatbox.lly());
-  list_t *tiles = blob->search (signode, &mat);
-  emit_layer_rects (fp, tiles);
+  const flat_layout *f = blob->flatten ();
+  emit_layer_rects (fp, f, mat, signode);
 
   fprintf (fp, "        END\n");
 
   // now we emit just the fet area for antennas
-  emit_antenna_area (fp, tiles);
-
-  LayoutBlob::searchFree (tiles);
+  emit_antenna_area (fp, f, signode);
 
   fprintf (fp, "    END ");
   a->mfprintf (fp, "%s", name);
@@ -2355,6 +3114,14 @@ void ActStackLayout::_getNetDetails (Process *p, unsigned long *ncount,
 
 void ActStackLayout::runrec (int mode, UserDef *u)
 {
+  if (mode == 6) {
+    /* fused walk: finish up modes 1, 4, and 3 */
+    runrec (1, u);
+    runrec (4, u);
+    runrec (3, u);
+    _maxht_proc = dynamic_cast<Process *> (u);
+    return;
+  }
   if (mode == 1) {
     /* emitLEF */
     
@@ -2426,6 +3193,14 @@ void ActStackLayout::runrec (int mode, UserDef *u)
     for (int i=0; i < config_get_table_size ("act.dev_flavors"); i++) {
       _emitwelltaprect (i);
     }
+    ActDynamicPass *dp = dynamic_cast<ActDynamicPass *>(me);
+    if (dp) {
+      dp->setParam ("rect_written", _rect_written);
+      dp->setParam ("rect_unchanged", _rect_unchanged);
+    }
+    /* the counts are per emission run */
+    _rect_written = 0;
+    _rect_unchanged = 0;
   }
   else if (mode == 5) {
     /* emitDEF */
@@ -2436,13 +3211,17 @@ void ActStackLayout::runrec (int mode, UserDef *u)
     double bb_x;
     double bb_y;
     int is_bb = 0;
+    int is_stream = 0;
     int do_pins;
     ActDynamicPass *dp = dynamic_cast<ActDynamicPass *>(me);
     if (!p || !dp) {
       return;
     }
 
-    dp->run_recursive (p, 3);
+    if (_maxht_proc != p) {
+      dp->run_recursive (p, 3);
+    }
+    _maxht_proc = NULL;
     dp->setParam ("cell_maxheight", _maxht);
     
     fp = (FILE *) dp->getPtrParam ("def_file");
@@ -2450,15 +3229,25 @@ void ActStackLayout::runrec (int mode, UserDef *u)
     if (dp->hasParam("is_bb")) {
       is_bb = dp->getIntParam ("is_bb");
     }
+    if (dp->hasParam ("def_stream")) {
+      is_stream = dp->getIntParam ("def_stream");
+    }
+    _def_threads = 1;
+    if (dp->hasParam ("def_threads")) {
+      _def_threads = dp->getIntParam ("def_threads");
+      if (_def_threads < 1) {
+	_def_threads = 1;
+      }
+    }
     if (is_bb) {
       bb_x = dp->getRealParam ("bb_x");
       bb_y = dp->getRealParam ("bb_y");
-      emitDEF (fp, p, bb_x, bb_y, do_pins, true);
+      emitDEF (fp, p, bb_x, bb_y, do_pins, true, is_stream);
     }
     else {
       area_mult = dp->getRealParam ("area_mult");
       aspect_ratio = dp->getRealParam ("aspect_ratio");
-      emitDEF (fp, p, area_mult, aspect_ratio, do_pins, false);
+      emitDEF (fp, p, area_mult, aspect_ratio, do_pins, false, is_stream);
     }
     
     dp->setParam ("total_area", _total_area);
@@ -2882,15 +3671,13 @@ int ActStackLayout::_emitlocalLEF (Process *p)
   /* read non-pin metal */
 
   if (blob->getRead ()) {
-    list_t *l;
     Rectangle bloatbox = blob->getBloatBBox ();
     TransformMat mat;
     mat.translate (-bloatbox.llx(), -bloatbox.lly());
-    l = blob->searchAllMetal (&mat);
-    if (emit_layer_rects (fp, l, iopins, A_LEN (iopins))) {
+    if (emit_layer_rects (fp, blob->flatten (), mat, NULL,
+			  iopins, A_LEN (iopins))) {
       fprintf (fp, "    END\n");
     }
-    LayoutBlob::searchFree (l);
   }
   else {
     /* XXX: add obstructions for metal layers; in reality we need to
@@ -2941,18 +3728,29 @@ void ActStackLayout::_computeWell (LayoutBlob *blob, int flavor, int type,
   Rectangle bloatbox = blob->getBloatBBox ();
   mat.translate (-bloatbox.llx(), -bloatbox.lly());
 
-  list_t *tiles;
+  int attr;
   if (is_welltap) {
-    tiles = blob->search (TILE_FLGS_TO_ATTR(flavor,type,WDIFF_OFFSET), &mat);
+    attr = TILE_FLGS_TO_ATTR(flavor,type,WDIFF_OFFSET);
   }
   else {
-    tiles = blob->search (TILE_FLGS_TO_ATTR(flavor,type,DIFF_OFFSET), &mat);
+    attr = TILE_FLGS_TO_ATTR(flavor,type,DIFF_OFFSET);
   }
   
   long wllx, wlly, wurx, wury;
 
-  LayoutBlob::searchBBox (tiles, &wllx, &wlly, &wurx, &wury);
-  LayoutBlob::searchFree (tiles);
+  Rectangle wr = blob->searchBBox (attr, &mat);
+  if (wr.empty()) {
+    wllx = 0;
+    wlly = 0;
+    wurx = -1;
+    wury = -1;
+  }
+  else {
+    wllx = wr.llx();
+    wlly = wr.lly();
+    wurx = wr.urx() + 1;
+    wury = wr.ury() + 1;
+  }
   if (wurx >= wllx) {
     /* bloat the region based on well overhang */
     if (is_welltap) {
@@ -3503,23 +4301,98 @@ static void count_inst (void *x, ActId *prefix, UserDef *u)
 }
 
 /*
- * Flat instance dump
+ * Hierarchical name prefix used during DEF emission.
+ *
+ * The instance hierarchy is walked recursively, and every level
+ * appends its mangled instance name followed by the mangled hierarchy
+ * separator to a single buffer. This means the prefix for a level is
+ * formatted and mangled exactly once, and then reused for all the
+ * components, nets, and pins below it. Mangling is done one character
+ * at a time, so the concatenation of mangled components is the same
+ * as the mangled full name.
+ *
+ * The prefix is per-thread, since the NETS section can be generated by
+ * multiple worker threads.
  */
 static Act *global_act;
 static ActStackLayout *_alp;
 
-static void dump_inst (void *x, ActId *prefix, UserDef *u)
+static thread_local char *_prefix_buf = NULL;
+static thread_local int _prefix_len = 0;
+static thread_local int _prefix_max = 0;
+static thread_local int _prefix_seplen = 0;
+
+/*
+ * Append the mangled name "id." to the prefix. Returns the previous
+ * length of the prefix, used to pop it.
+ */
+static int _prefix_push (ActId *id)
 {
-  FILE *fp = (FILE *)x;
   char buf[10240];
-  LayoutBlob *b;
-  long llx, lly, urx, ury;
+  char mbuf[10240];
+  int len, old;
 
-  Process *p = dynamic_cast<Process *>(u);
-  if (!p) {
-    return;
+  id->sPrint (buf, 10240);
+  global_act->msnprintf (mbuf, 10240, "%s.", buf);
+  len = strlen (mbuf);
+
+  if (_prefix_seplen == 0) {
+    global_act->msnprintf (buf, 10240, ".");
+    _prefix_seplen = strlen (buf);
   }
-  
+
+  if (_prefix_len + len + 1 > _prefix_max) {
+    _prefix_max = _prefix_len + len + 1024;
+    REALLOC (_prefix_buf, char, _prefix_max);
+  }
+  old = _prefix_len;
+  memcpy (_prefix_buf + _prefix_len, mbuf, len + 1);
+  _prefix_len += len;
+  return old;
+}
+
+static void _prefix_pop (int len)
+{
+  _prefix_len = len;
+  if (_prefix_buf) {
+    _prefix_buf[len] = '\0';
+  }
+}
+
+/* release the prefix buffer of the calling thread */
+static void _prefix_free ()
+{
+  if (_prefix_buf) {
+    FREE (_prefix_buf);
+  }
+  _prefix_buf = NULL;
+  _prefix_len = 0;
+  _prefix_max = 0;
+}
+
+/* print the current prefix, including the trailing separator */
+static void _prefix_print (FILE *fp)
+{
+  if (_prefix_len > 0) {
+    fwrite (_prefix_buf, 1, _prefix_len, fp);
+  }
+}
+
+/* print the current prefix as an instance name */
+static void _prefix_print_inst (FILE *fp)
+{
+  Assert (_prefix_len > _prefix_seplen, "Empty instance name?");
+  fwrite (_prefix_buf, 1, _prefix_len - _prefix_seplen, fp);
+}
+
+
+/*
+ * Flat instance dump
+ */
+static void dump_inst (FILE *fp, Process *p)
+{
+  long llx, lly, urx, ury;
+
   if (_alp->getBBox (p, &llx, &lly, &urx, &ury)) {
     if ((llx > urx) || (lly > ury)) return;
 
@@ -3528,13 +4401,58 @@ static void dump_inst (void *x, ActId *prefix, UserDef *u)
          - inst2591 NAND4X2 + PLACED ( 100000 71820 ) N ;   <- pre-placed
     */
     fprintf (fp, "- ");
-    prefix->sPrint (buf, 10240);
-    global_act->mfprintf (fp, "%s ", buf);
+    _prefix_print_inst (fp);
+    fprintf (fp, " ");
     global_act->mfprintfproc (fp, p);
     fprintf (fp, " ;\n");
   }
 }
 
+static void _collect_emit_inst (Process *p, FILE *fp)
+{
+  Assert (p->isExpanded(), "What are we doing");
+
+  ActUniqProcInstiter i(p->CurScope());
+
+  for (i = i.begin(); i != i.end(); i++) {
+    ValueIdx *vx = (*i);
+    ActId *newid;
+    int len;
+
+    Process *instproc = dynamic_cast<Process *>(vx->t->BaseType ());
+
+    newid = new ActId (vx->getName());
+
+    if (vx->t->arrayInfo()) {
+      Arraystep *as = vx->t->arrayInfo()->stepper();
+      while (!as->isend()) {
+	if (vx->isPrimary (as->index())) {
+	  if (as->curProc() != instproc) {
+	    instproc = as->curProc();
+	  }
+	  Array *x = as->toArray();
+	  newid->setArray (x);
+	  len = _prefix_push (newid);
+	  dump_inst (fp, instproc);
+	  _collect_emit_inst (instproc, fp);
+	  _prefix_pop (len);
+	  delete x;
+	  newid->setArray (NULL);
+	}
+	as->step();
+      }
+      delete as;
+    }
+    else {
+      len = _prefix_push (newid);
+      dump_inst (fp, instproc);
+      _collect_emit_inst (instproc, fp);
+      _prefix_pop (len);
+    }
+    delete newid;
+  }
+}
+
 static const char *global_vdd = NULL;
 static const char *global_gnd = NULL;
 static const char *local_vdd = NULL;
@@ -3565,23 +4483,24 @@ static bool _is_global_supply (ActId *sig)
   return false;
 }
 
-static int print_net (Act *a, FILE *fp, ActId *prefix, act_local_net_t *net,
-		      int toplevel, int pins)
+/* returns 1 if the net is emitted in the NETS section, 0 otherwise */
+static int _emit_net_ok (act_local_net_t *net, int toplevel, int pins)
 {
-  char buf[10240];
-  Assert (net, "Why are you calling this function?");
   if (net->skip) return 0;
   if (net->port && (!toplevel || !pins)) return 0;
-
   if (A_LEN (net->pins) < 1) return 0;
+  return 1;
+}
+
+static int print_net (Act *a, FILE *fp, act_local_net_t *net,
+		      int toplevel, int pins)
+{
+  char buf[10240];
+  Assert (net, "Why are you calling this function?");
+  if (!_emit_net_ok (net, toplevel, pins)) return 0;
 
   fprintf (fp, "- ");
-  if (prefix) {
-    prefix->sPrint (buf, 10240);
-    global_act->mfprintf (fp, "%s.", buf);
-    //prefix->Print (fp);
-    //fprintf (fp, ".");
-  }
+  _prefix_print (fp);
   ActId *tmp = net->net->primary()->toid();
   tmp->sPrint (buf, 10240);
   global_act->mfprintf (fp, "%s", buf);
@@ -3612,10 +4531,7 @@ static int print_net (Act *a, FILE *fp, ActId *prefix, act_local_net_t *net,
 
   for (int i=0; i < A_LEN (net->pins); i++) {
     fprintf (fp, " ( ");
-    if (prefix) {
-      prefix->sPrint (buf, 10240);
-      a->mfprintf (fp, "%s.", buf);
-    }
+    _prefix_print (fp);
     net->pins[i].inst->sPrint (buf, 10240);
     a->mfprintf (fp, "%s ", buf);
 
@@ -3630,11 +4546,11 @@ static int print_net (Act *a, FILE *fp, ActId *prefix, act_local_net_t *net,
   return 1;
 }
 
-static unsigned long netcount;
+static thread_local unsigned long netcount;
 
 static ActBooleanizePass *boolinfo;
 
-void _collect_emit_nets (Act *a, ActId *prefix, Process *p, FILE *fp, int do_pins)
+void _collect_emit_nets (Act *a, Process *p, FILE *fp, int do_pins)
 {
   Assert (p->isExpanded(), "What are we doing");
 
@@ -3643,7 +4559,7 @@ void _collect_emit_nets (Act *a, ActId *prefix, Process *p, FILE *fp, int do_pin
 
   /* first, print my local nets */
   for (int i=0; i < A_LEN (n->nets); i++) {
-    if (print_net (a, fp, prefix, &n->nets[i], prefix == NULL ? (i+1) : 0, do_pins)) {
+    if (print_net (a, fp, &n->nets[i], _prefix_len == 0 ? (i+1) : 0, do_pins)) {
       netcount++;
     }
   }
@@ -3653,22 +4569,11 @@ void _collect_emit_nets (Act *a, ActId *prefix, Process *p, FILE *fp, int do_pin
   for (i = i.begin(); i != i.end(); i++) {
     ValueIdx *vx = (*i);
     ActId *newid;
-    ActId *cpy;
+    int len;
     
     Process *instproc = dynamic_cast<Process *>(vx->t->BaseType ());
 
     newid = new ActId (vx->getName());
-    if (prefix) {
-      cpy = prefix->Clone ();
-      ActId *tmp = cpy;
-      while (tmp->Rest()) {
-	tmp = tmp->Rest();
-      }
-      tmp->Append (newid);
-    }
-    else {
-      cpy = newid;
-    }
 
     if (vx->t->arrayInfo()) {
       Arraystep *as = vx->t->arrayInfo()->stepper();
@@ -3679,7 +4584,9 @@ void _collect_emit_nets (Act *a, ActId *prefix, Process *p, FILE *fp, int do_pin
 	  }
 	  Array *x = as->toArray();
 	  newid->setArray (x);
-	  _collect_emit_nets (a, cpy, instproc, fp, do_pins);
+	  len = _prefix_push (newid);
+	  _collect_emit_nets (a, instproc, fp, do_pins);
+	  _prefix_pop (len);
 	  delete x;
 	  newid->setArray (NULL);
 	}
@@ -3688,14 +4595,220 @@ void _collect_emit_nets (Act *a, ActId *prefix, Process *p, FILE *fp, int do_pin
       delete as;
     }
     else {
-      _collect_emit_nets (a, cpy, instproc, fp, do_pins);
+      len = _prefix_push (newid);
+      _collect_emit_nets (a, instproc, fp, do_pins);
+      _prefix_pop (len);
     }
-    delete cpy;
+    delete newid;
   }
   return;
 }
 
 
+/*
+ * Parallel NETS emission. The top-level nets are printed directly;
+ * each primary top-level instance is an independent chunk of work
+ * that is rendered by a worker thread into its own memory buffer.
+ * Chunks are processed in windows of a bounded size, and the buffers
+ * for a window are written out in instance iteration order so the
+ * output is identical to the sequential version.
+ */
+struct def_net_chunk {
+  ActId *id;			// top-level instance name
+  Process *proc;		// its type
+  char *buf;			// rendered nets
+  size_t len;
+  unsigned long count;		// # of nets in buf
+  int done;			// 1 once buf is ready; guarded by the lock
+};
+
+static void _emit_nets_chunk (Act *a, def_net_chunk *c, int do_pins)
+{
+  FILE *fp = open_memstream (&c->buf, &c->len);
+  if (!fp) {
+    fatal_error ("emitDEF: could not create buffer for nets");
+  }
+  netcount = 0;
+  _prefix_pop (0);
+  _prefix_push (c->id);
+  _collect_emit_nets (a, c->proc, fp, do_pins);
+  _prefix_pop (0);
+  fclose (fp);
+  c->count = netcount;
+}
+
+static void _collect_emit_nets_par (Act *a, Process *p, FILE *fp,
+				    int do_pins, int nthreads)
+{
+  A_DECL (def_net_chunk, chunks);
+  A_INIT (chunks);
+
+  Assert (p->isExpanded(), "What are we doing");
+
+  act_boolean_netlist_t *n = boolinfo->getBNL (p);
+  Assert (n, "What!");
+
+  /* initialize globals before starting any workers */
+  _initglobals ();
+
+  /* top-level nets */
+  netcount = 0;
+  _prefix_pop (0);
+  for (int i=0; i < A_LEN (n->nets); i++) {
+    if (print_net (a, fp, &n->nets[i], i+1, do_pins)) {
+      netcount++;
+    }
+  }
+
+  /* collect the top-level instances, in iteration order */
+  ActUniqProcInstiter i(p->CurScope());
+
+  for (i = i.begin(); i != i.end(); i++) {
+    ValueIdx *vx = (*i);
+    Process *instproc = dynamic_cast<Process *>(vx->t->BaseType ());
+
+    if (vx->t->arrayInfo()) {
+      Arraystep *as = vx->t->arrayInfo()->stepper();
+      while (!as->isend()) {
+	if (vx->isPrimary (as->index())) {
+	  if (as->curProc() != instproc) {
+	    instproc = as->curProc();
+	  }
+	  A_NEW (chunks, def_net_chunk);
+	  A_NEXT (chunks).id = new ActId (vx->getName(), as->toArray());
+	  A_NEXT (chunks).proc = instproc;
+	  A_INC (chunks);
+	}
+	as->step();
+      }
+      delete as;
+    }
+    else {
+      A_NEW (chunks, def_net_chunk);
+      A_NEXT (chunks).id = new ActId (vx->getName());
+      A_NEXT (chunks).proc = instproc;
+      A_INC (chunks);
+    }
+  }
+
+  /* nthreads workers claim chunks in order; the main thread writes
+     each chunk as soon as it is ready. Workers stay at most a window
+     of chunks ahead of the writer to bound the buffered output. */
+  int window = 4*nthreads;
+  int nchunks = A_LEN (chunks);
+  int written = 0;
+  unsigned long total = netcount;
+  std::atomic<int> next (0);
+  std::mutex lock;
+  std::condition_variable ready, drained;
+
+  for (int j=0; j < nchunks; j++) {
+    chunks[j].done = 0;
+  }
+
+  int nw = nthreads;
+  if (nw > nchunks) {
+    nw = nchunks;
+  }
+  std::thread *workers = new std::thread[nw];
+  for (int k=0; k < nw; k++) {
+    workers[k] = std::thread ([&] () {
+	int j;
+	while ((j = next++) < nchunks) {
+	  {
+	    std::unique_lock<std::mutex> g(lock);
+	    drained.wait (g, [&] { return j < written + window; });
+	  }
+	  _emit_nets_chunk (a, &chunks[j], do_pins);
+	  {
+	    std::lock_guard<std::mutex> g(lock);
+	    chunks[j].done = 1;
+	  }
+	  ready.notify_one ();
+	}
+	_prefix_free ();
+      });
+  }
+
+  for (int j=0; j < nchunks; j++) {
+    {
+      std::unique_lock<std::mutex> g(lock);
+      ready.wait (g, [&] { return chunks[j].done != 0; });
+    }
+    fwrite (chunks[j].buf, 1, chunks[j].len, fp);
+    total += chunks[j].count;
+    free (chunks[j].buf);
+    delete chunks[j].id;
+    {
+      std::lock_guard<std::mutex> g(lock);
+      written = j + 1;
+    }
+    drained.notify_all ();
+  }
+
+  for (int k=0; k < nw; k++) {
+    workers[k].join ();
+  }
+  delete [] workers;
+  A_FREE (chunks);
+  netcount = total;
+}
+
+
+/*
+ * Count the nets emitted by _collect_emit_nets without printing
+ * anything. The count for a non-top-level process only depends on its
+ * type, so it is computed once per process and cached in H.
+ */
+static unsigned long _count_emit_nets (Process *p, int toplevel, int do_pins,
+				       std::map<Process *, unsigned long> &H)
+{
+  unsigned long count = 0;
+
+  if (!toplevel) {
+    std::map<Process *, unsigned long>::iterator it = H.find (p);
+    if (it != H.end()) {
+      return it->second;
+    }
+  }
+
+  act_boolean_netlist_t *n = boolinfo->getBNL (p);
+  Assert (n, "What!");
+
+  for (int i=0; i < A_LEN (n->nets); i++) {
+    count += _emit_net_ok (&n->nets[i], toplevel ? (i+1) : 0, do_pins);
+  }
+
+  ActUniqProcInstiter i(p->CurScope());
+
+  for (i = i.begin(); i != i.end(); i++) {
+    ValueIdx *vx = (*i);
+    Process *instproc = dynamic_cast<Process *>(vx->t->BaseType ());
+
+    if (vx->t->arrayInfo()) {
+      Arraystep *as = vx->t->arrayInfo()->stepper();
+      while (!as->isend()) {
+	if (vx->isPrimary (as->index())) {
+	  if (as->curProc() != instproc) {
+	    instproc = as->curProc();
+	  }
+	  count += _count_emit_nets (instproc, 0, do_pins, H);
+	}
+	as->step();
+      }
+      delete as;
+    }
+    else {
+      count += _count_emit_nets (instproc, 0, do_pins, H);
+    }
+  }
+  if (!toplevel) {
+    H[p] = count;
+  }
+  return count;
+}
+
+
 void ActStackLayout::emitDEFHeader (FILE *fp, Process *p)
 {
   /* -- def header -- */
@@ -3711,7 +4824,8 @@ void ActStackLayout::emitDEFHeader (FILE *fp, Process *p)
 }
 
 void ActStackLayout::emitDEF (FILE *fp, Process *p, double pad,
-				  double ratio, int do_pins, bool is_bounding_box)
+			      double ratio, int do_pins, bool is_bounding_box,
+			      bool is_stream)
 {
   ActDynamicPass *dp = dynamic_cast<ActDynamicPass *>(me);
   Assert (dp, "What?");
@@ -3842,11 +4956,10 @@ void ActStackLayout::emitDEF (FILE *fp, Process *p, double pad,
 
   /* -- instances  -- */
   fprintf (fp, "COMPONENTS %d ;\n", _total_instances);
-  ap->setCookie (fp);
-  ap->setInstFn (dump_inst);
   global_act = a;
   _alp = this;
-  ap->run (p);
+  _prefix_pop (0);
+  _collect_emit_inst (p, fp);
   fprintf (fp, "END COMPONENTS\n\n");
 
 
@@ -3928,11 +5041,27 @@ void ActStackLayout::emitDEF (FILE *fp, Process *p, double pad,
   fprintf (fp, "END PINS\n\n");
 
   netcount = 0;
-  unsigned long pos = 0;
+  long pos = 0;
 
   /* -- nets -- */
-  pos = ftell (fp);
-  fprintf (fp, "NETS %012lu ;\n", netcount);
+  if (!is_stream) {
+    pos = ftell (fp);
+    if (pos < 0) {
+      /* output is not seekable (pipe, FIFO, etc.) */
+      is_stream = true;
+    }
+  }
+
+  unsigned long expected = 0;
+  if (is_stream) {
+    /* count first, then write the NETS section forward-only */
+    std::map<Process *, unsigned long> H;
+    expected = _count_emit_nets (p, 1, do_pins, H);
+    fprintf (fp, "NETS %12lu ;\n", expected);
+  }
+  else {
+    fprintf (fp, "NETS %012lu ;\n", netcount);
+  }
   /*
     Output format: 
 
@@ -3940,15 +5069,28 @@ void ActStackLayout::emitDEF (FILE *fp, Process *p, double pad,
     ( inst5638 A ) ( inst4678 Y )
     ;
   */
-  _collect_emit_nets (a, NULL, p, fp, do_pins);
+  if (_def_threads > 1) {
+    _collect_emit_nets_par (a, p, fp, do_pins, _def_threads);
+  }
+  else {
+    _collect_emit_nets (a, p, fp, do_pins);
+  }
   
   fprintf (fp, "END NETS\n\n");
   fprintf (fp, "END DESIGN\n");
 
-  fseek (fp, pos, SEEK_SET);
+  if (is_stream) {
+    if (expected != netcount) {
+      warning ("emitDEF: NETS count mismatch (%lu counted, %lu emitted)",
+	       expected, netcount);
+    }
+  }
+  else {
+    fseek (fp, pos, SEEK_SET);
   
-  fprintf (fp, "NETS %12lu ;\n", netcount);
-  fseek (fp, 0, SEEK_END);
+    fprintf (fp, "NETS %12lu ;\n", netcount);
+    fseek (fp, 0, SEEK_END);
+  }
   global_act = NULL;
 }
 
@@ -4488,6 +5630,38 @@ int _layoutcmd_configrefresh (ActDynamicPass *ap, ActStackLayout *lp)
   return 1;
 }
 
+/*
+ *  Re-read any imported .rect files that have changed; the number of
+ *  files re-read is returned in "rect_refreshed"
+ */
+static int _layoutcmd_rectrefresh (ActDynamicPass *ap, ActStackLayout *lp)
+{
+  if (!ap->completed()) {
+    return 0;
+  }
+  ap->setParam ("rect_refreshed", lp->refreshRect ());
+  return 1;
+}
+
+/*
+ *  Read in the .rect files for the design rooted at "rect_top" on
+ *  "rect_threads" worker threads before the layout pass runs.
+ */
+static int _layoutcmd_rectprefetch (ActDynamicPass *ap, ActStackLayout *lp)
+{
+  Process *p = (Process *) ap->getPtrParam ("rect_top");
+  int nthreads = 1;
+
+  if (!p) {
+    return 0;
+  }
+  if (ap->hasParam ("rect_threads")) {
+    nthreads = ap->getIntParam ("rect_threads");
+  }
+  lp->prefetchRect (p, nthreads);
+  return 1;
+}
+
 /*
  * Used to invoke specific commands about the layout package
  */
@@ -4508,6 +5682,12 @@ int layout_runcmd (ActPass *_ap, const char *name)
   else if (strcmp (name, "config_refresh") == 0) {
     return _layoutcmd_configrefresh (ap, lp);
   }
+  else if (strcmp (name, "rect_prefetch") == 0) {
+    return _layoutcmd_rectprefetch (ap, lp);
+  }
+  else if (strcmp (name, "rect_refresh") == 0) {
+    return _layoutcmd_rectrefresh (ap, lp);
+  }
   else {
     return -1;
   }
@@ -4665,6 +5845,10 @@ void ActStackLayout::reportDirs (FILE *fp)
 
   fprintf (fp, "    outinitdir: %s\n", _rect_outinitdir ? _rect_outinitdir : "none");
   fprintf (fp, "    outdir: %s\n", _rect_outdir ? _rect_outdir : "none");
+  if (_rect_cache) {
+    fprintf (fp, "    cachedir: %s\n",
+	     _rect_cachedir ? _rect_cachedir : "(with .rect files)");
+  }
 }
 
 
@@ -33,6 +33,7 @@
 class ActStackLayout {
 public:
   ActStackLayout (ActPass *a);
+  ~ActStackLayout ();
 
   LayoutBlob *getLayout (Process *p = NULL);
 
@@ -55,6 +56,8 @@ public:
   int getImport () { return _rect_import; }
   void reportDirs (FILE *fp);
   void cacheConfig ();
+  void prefetchRect (Process *top, int nthreads);
+  int refreshRect ();
 
   struct pHashtable *getStats() { return _cellStats; }
   void _getAreaInfo (Process *p, unsigned long *dx, unsigned long *dy);
@@ -63,6 +66,12 @@ public:
   int _localdiffspace (Process *p);
 
   LayoutBlob *_readlocalRect (Process *p);
+  LayoutBlob *_finishlocalRect (Process *p, const char *cname,
+				LayoutBlob *b, Rectangle &file_bbox);
+  void _recordRect (Process *p, const char *file);
+  void _recordCellRects ();
+  void _forgetCellRect (const char *name);
+  char *_rectInpath (const char *cname);
 
   /* mode 0 */
   LayoutBlob *_createlocallayout (Process *p);
@@ -88,11 +97,23 @@ public:
 
   /* mode 4 */
   void _emitlocalRect (Process *p);
+  void _writeRect (const char *outdir, const char *name,
+		   const char *buf, size_t len);
+  void _writeRectplain (const char *outname, const char *buf, size_t len);
+  void _writeRectgz (const char *outname, const char *buf, size_t len);
+  char *_rectTmpname (const char *outname);
+  int _rect_written;		// # of .rect files written
+  int _rect_unchanged;		// # of .rect files left as-is
+
+  /* mode 6: modes 1, 4, and 3 in a single walk of the hierarchy */
+  Process *_maxht_proc;		// process mode 6 computed _maxht for
 
   /* this is mode 5 */
   void emitDEFHeader (FILE *fp, Process *p);
   /* pad doubles as bb_x, ratio as bb_y if is_bounding_box is true*/
-  void emitDEF (FILE *fp, Process *p, double pad = 1.4, double ratio = 1.0, int do_pins = 1, bool is_bounding_box = false);
+  /* is_stream: write forward-only, for outputs that can't be
+     seeked (pipes, FIFOs); nets are counted in a pre-pass */
+  void emitDEF (FILE *fp, Process *p, double pad = 1.4, double ratio = 1.0, int do_pins = 1, bool is_bounding_box = false, bool is_stream = false);
   
   /* welltap */
   LayoutBlob **wellplugs;
@@ -105,6 +126,7 @@ public:
   /* layoutblob list following the shared staticizer type list */
   list_t *_weak_supplies;
   LayoutBlob *_create_weaksupply (ActNetlistPass::shared_stat *s);
+  void _freeCells ();
 
 
   /* compute aligned LEF boundary */
@@ -141,6 +163,7 @@ public:
   /* arguments */
   FILE *_fp, *_fpcell;
   int _do_rect;
+  int _def_threads;		// # of worker threads for DEF NETS
 
   const char *_version;
   unsigned int _micron_conv;
@@ -159,6 +182,12 @@ public:
   const char *_rect_outdir;	// rect output directory, if any
   const char *_rect_outinitdir; // rect output directory for initial
 				// unwired layout
+  int _rect_compress;		// 1 if .rect files are written as .rect.gz
+  int _rect_cache;		// 1 if binary .rectb caches are used
+  const char *_rect_cachedir;	// .rectb directory, if any
+  struct pHashtable *_rect_prefetch; // .rect files read in ahead of time
+  struct pHashtable *_rect_files; // imported .rect files, for refreshRect
+  struct Hashtable *_rect_cellfiles; // .rect files read in for cell lines
 
   int _extra_tracks_top;
   int _extra_tracks_bot;
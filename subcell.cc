@@ -19,6 +19,7 @@
  *
  **************************************************************************
  */
+#include <algorithm>
 #include "subcell.h"
 
 int LayerSubcell::subcell_level_threshold = 10;
@@ -26,6 +27,131 @@ int LayerSubcell::subcell_level_threshold = 10;
 // This must be always larger than subcell_level_threshold
 int LayerSubcell::subcell_recompute_threshold = 200;
 
+/* a subcell along with its bounding box, used while partitioning */
+struct subcell_box {
+  SubcellInst *c;
+  Rectangle r;
+};
+
+LayerSubcell::~LayerSubcell ()
+{
+  if (_leq) {
+    delete _leq;
+  }
+  if (_gt) {
+    delete _gt;
+  }
+  for (int i=0; i < A_LEN (_lst); i++) {
+    delete _lst[i];
+  }
+  A_FREE (_lst);
+}
+
+/* insert s into the sorted array of subcells at this level */
+void LayerSubcell::_lstAdd (SubcellInst *s)
+{
+  long k = _key (s);
+  int lo = 0, hi = A_LEN (_lst);
+
+  // first entry with a larger key
+  while (lo < hi) {
+    int mid = (lo + hi)/2;
+    if (_key (_lst[mid]) <= k) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  A_NEW (_lst, SubcellInst *);
+  if (lo < A_LEN (_lst)) {
+    memmove (_lst + lo + 1, _lst + lo,
+	     sizeof (SubcellInst *)*(A_LEN (_lst) - lo));
+  }
+  _lst[lo] = s;
+  A_INC (_lst);
+}
+
+/* remove and delete s from the subcells at this level */
+void LayerSubcell::_lstDel (SubcellInst *s)
+{
+  long k = _key (s);
+  int lo = 0, hi = A_LEN (_lst);
+
+  // first entry with the same key
+  while (lo < hi) {
+    int mid = (lo + hi)/2;
+    if (_key (_lst[mid]) < k) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  while (lo < A_LEN (_lst) && _lst[lo] != s) {
+    lo++;
+  }
+  Assert (lo < A_LEN (_lst), "LayerSubcell: subcell not found");
+  memmove (_lst + lo, _lst + lo + 1,
+	   sizeof (SubcellInst *)*(A_LEN (_lst) - lo - 1));
+  A_LEN (_lst)--;
+  delete s;
+}
+
+/*
+ * The child sub-tree that r belongs to, or NULL if it straddles the
+ * split (or there is no split)
+ */
+LayerSubcell *LayerSubcell::_child (const Rectangle &r)
+{
+  if (!_leq) {
+    return NULL;
+  }
+  if (_splitx) {
+    if (_splitval < r.llx()) {
+      return _gt;
+    }
+    else if (r.urx() <= _splitval) {
+      return _leq;
+    }
+  }
+  else {
+    if (_splitval < r.lly()) {
+      return _gt;
+    }
+    else if (r.ury() <= _splitval) {
+      return _leq;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * A sub-tree is re-partitioned when a leaf exceeds the level
+ * threshold, when too many subcells straddle the split, or when one
+ * side has more than 3/4 of the subcells. It must also have grown by
+ * half since it was last partitioned, so the cost of re-partitioning
+ * is amortized over the insertions (and subcells that can't be
+ * separated don't trigger it on every insertion).
+ */
+bool LayerSubcell::_needRepartition ()
+{
+  if (2*_count < 3*_built) {
+    return false;
+  }
+  if (!_leq) {
+    return A_LEN (_lst) > subcell_level_threshold;
+  }
+  if (A_LEN (_lst) > subcell_recompute_threshold) {
+    return true;
+  }
+  if (_count > subcell_level_threshold &&
+      4*MAX(_leq->_count, _gt->_count) > 3*_count) {
+    return true;
+  }
+  return false;
+}
+
 void LayerSubcell::addSubcell (SubcellInst *s)
 {
   const Rectangle &r = s->getBBox ();
@@ -34,201 +160,309 @@ void LayerSubcell::addSubcell (SubcellInst *s)
     _computeBBox();
   }
   _bbox = _bbox ^ r;
-  if (_leq || _gt) {
-    if (_leq->_splitx) {
-      if (_splitval < r.llx()) {
-	_gt->addSubcell (s);
-      }
-      else if (r.urx() <= _splitval) {
-	_leq->addSubcell (s);
+  _bloatbbox = _bloatbbox ^ s->getBloatBBox ();
+  _abutbox = _abutbox ^ s->getAbutBox ();
+  _count++;
+
+  LayerSubcell *ch = _child (r);
+  if (ch) {
+    ch->addSubcell (s);
+  }
+  else {
+    // add to this level
+    _lstAdd (s);
+  }
+  if (_needRepartition ()) {
+    _repartition ();
+  }
+}
+  
+
+void LayerSubcell::delSubcell (SubcellInst *s)
+{
+  const Rectangle &r = s->getBBox ();
+  Assert (_region.contains (r), "What?");
+  _bbox.clear ();
+  _bloatbbox.clear();
+  _abutbox.clear ();
+
+  LayerSubcell *ch = _child (r);
+  if (ch) {
+    ch->delSubcell (s);
+  }
+  else {
+    _lstDel (s);
+  }
+  _count--;
+}
+
+void LayerSubcell::rebalance ()
+{
+  _repartition ();
+}
+
+void LayerSubcell::addSubcells (SubcellInst **a, int n)
+{
+  if (n > 0) {
+    _repartition (a, n);
+  }
+}
+
+void LayerSubcell::query (const Rectangle &r, void *cookie,
+			  void (*f) (void *, SubcellInst *))
+{
+  if (_count == 0 || !getBBox().overlaps (r)) {
+    return;
+  }
+  for (int i=0; i < A_LEN (_lst); i++) {
+    Rectangle b = _lst[i]->getBBox();
+    // sorted, so the rest of them are past r
+    if (_splitx ? (b.llx() > r.urx()) : (b.lly() > r.ury())) {
+      break;
+    }
+    if (b.overlaps (r)) {
+      (*f) (cookie, _lst[i]);
+    }
+  }
+  if (_leq) {
+    if (_splitx) {
+      if (r.llx() <= _splitval) {
+	_leq->query (r, cookie, f);
       }
-      else {
-	// add to this level
-	_levelcount++;
-	if (!_lst) {
-	  _lst = new SubcellList (s);
-	}
-	else {
-	  _lst->append (s, _splitx == 1 ? true : false);
-	}
+      if (_splitval < r.urx()) {
+	_gt->query (r, cookie, f);
       }
     }
     else {
-      if (_splitval < r.lly()) {
-	_gt->addSubcell (s);
+      if (r.lly() <= _splitval) {
+	_leq->query (r, cookie, f);
       }
-      else if (r.ury() <= _splitval) {
-	_leq->addSubcell (s);
-      }
-      else {
-	_levelcount++;
-	if (!_lst) {
-	  _lst = new SubcellList (s);
-	}
-	else {
-	  _lst->append (s, _splitx == 1 ? true : false);
-	}
+      if (_splitval < r.ury()) {
+	_gt->query (r, cookie, f);
       }
     }
-    if (_levelcount > subcell_level_threshold) {
-      if (!_leq && !_gt) {
-	// find an x-split, and find a y-split
-	SubcellList *tmp;
-	double x_mean, y_mean;
-	x_mean = 0;
-	y_mean = 0;
-	for (tmp = _lst; tmp; tmp = tmp->getNext()) {
-	  SubcellInst *c = tmp->getCell();
-	  x_mean += (c->getBBox().llx() + c->getBBox().urx())/2;
-	  y_mean += (c->getBBox().lly() + c->getBBox().ury())/2;
-	}
-	x_mean /= _levelcount;
-	y_mean /= _levelcount;
-
-	int x_count_left, y_count_left;
-	x_count_left = 0;
-	y_count_left = 0;
-
-	for (tmp = _lst; tmp; tmp = tmp->getNext()) {
-	  SubcellInst *c = tmp->getCell();
-	  if (c->getBBox().urx() <= (long)x_mean) {
-	    x_count_left++;
-	  }
-	  if (c->getBBox().ury() <= (long)y_mean) {
-	    y_count_left++;
-	  }
-	}
-#ifndef ABS
-#define ABS(a) ((a) < 0 ? -(a) : (a))
-#endif
-	unsigned int x_gap, y_gap;
-	x_gap = ABS(_levelcount/2-x_count_left);
-	y_gap = ABS(_levelcount/2-y_count_left);
-
-
-	// create left, right sub-trees
-	if (x_gap < y_gap || (x_gap == y_gap && _splitx == 0)) {
-	  _leq = new LayerSubcell (true);
-	  _gt = new LayerSubcell (true);
-	  _splitval = x_mean;
-
-	  // split in the x direction. 
-	  Rectangle r = _region;
-	  r.setXMax (_splitval);
-	  _leq->setRegion (r);
-	  r = _region;
-	  r.setXMin (_splitval+1);
-	  _gt->setRegion (r);
-	}
-	else {
-	  _splitval = y_mean;
-	  _leq = new LayerSubcell (false);
-	  _gt = new LayerSubcell (false);
-
-	  // split in the y direction
-	  Rectangle r = _region;
-	  r.setYMax (_splitval);
-	  _leq->setRegion (r);
-	  r = _region;
-	  r.setYMin (_splitval+1);
-	  _gt->setRegion (r);
-	}
-	SubcellList *newlst = NULL;
-	for (tmp = _lst; tmp; tmp = tmp->getNext()) {
-	  SubcellInst *c = tmp->getCell();
-	  if (_leq->_splitx) {
-	    if (c->getBBox().urx() <= _splitval) {
-	      _leq->addSubcell (c);
-	      tmp->clearCell();
-	      _levelcount--;
-	    }
-	    else if (c->getBBox().llx() > _splitval) {
-	      _gt->addSubcell (c);
-	      tmp->clearCell();
-	      _levelcount--;
-	    }
-	  }
-	  else {
-	    if (c->getBBox().ury() <= _splitval) {
-	      _leq->addSubcell (c);
-	      tmp->clearCell();
-	      _levelcount--;
-	    }
-	    else if (c->getBBox().lly() > _splitval) {
-	      _gt->addSubcell (c);
-	      tmp->clearCell();
-	      _levelcount--;
-	    }
-	  }
-	}
-	// now delete the subcell that were moved out
-	_lst = _lst->flushClear ();
+  }
+}
+
+/*
+ * Move all the subcells in the sub-tree into a, and delete the
+ * sub-tree structure
+ */
+void LayerSubcell::_collect (SubcellInst **a, int *n)
+{
+  for (int i=0; i < A_LEN (_lst); i++) {
+    a[(*n)++] = _lst[i];
+  }
+  A_FREE (_lst);
+  A_INIT (_lst);
+  if (_leq) {
+    _leq->_collect (a, n);
+    delete _leq;
+    _leq = NULL;
+  }
+  if (_gt) {
+    _gt->_collect (a, n);
+    delete _gt;
+    _gt = NULL;
+  }
+  _count = 0;
+}
+
+/*
+ * Re-build the sub-tree from its subcells, plus the n subcells in
+ * extra if any
+ */
+void LayerSubcell::_repartition (SubcellInst **extra, int n)
+{
+  SubcellInst **a;
+  subcell_box *box;
+  int i, m, count;
+
+  count = _count;
+  if (count + n == 0) {
+    return;
+  }
+  MALLOC (a, SubcellInst *, count + 1);
+  m = 0;
+  _collect (a, &m);
+  Assert (m == count, "LayerSubcell: subcell count mismatch");
+  box = new subcell_box[m + n];
+  for (i=0; i < m; i++) {
+    box[i].c = a[i];
+    box[i].r = a[i]->getBBox();
+  }
+  FREE (a);
+  for (i=0; i < n; i++) {
+    box[m+i].c = extra[i];
+    box[m+i].r = extra[i]->getBBox();
+    Assert (_region.contains (box[m+i].r), "What?");
+  }
+  _build (box, m + n);
+  delete [] box;
+}
+
+static int _cmp_llx (const void *a, const void *b)
+{
+  long x = ((subcell_box *)a)->r.llx();
+  long y = ((subcell_box *)b)->r.llx();
+  return (x < y) ? -1 : (x > y ? 1 : 0);
+}
+
+static int _cmp_lly (const void *a, const void *b)
+{
+  long x = ((subcell_box *)a)->r.lly();
+  long y = ((subcell_box *)b)->r.lly();
+  return (x < y) ? -1 : (x > y ? 1 : 0);
+}
+
+/*
+ * Pick the split for a: the median of the right (top) edges of the
+ * boxes in x (y), whichever leaves fewer subcells straddling the
+ * split. Splitting on an edge rather than a center keeps abutting
+ * cells off the split line. Returns false if neither direction
+ * separates the subcells.
+ */
+bool LayerSubcell::_pickSplit (subcell_box *a, int n)
+{
+  long *mid;
+  long val[2];
+  int straddle[2];
+  bool ok[2];
+
+  MALLOC (mid, long, n);
+  for (int dir=0; dir < 2; dir++) {
+    int leq = 0, gt = 0;
+    for (int i=0; i < n; i++) {
+      const Rectangle &r = a[i].r;
+      mid[i] = dir ? r.urx() : r.ury();
+    }
+    std::nth_element (mid, mid + (n-1)/2, mid + n);
+    val[dir] = mid[(n-1)/2];
+    for (int i=0; i < n; i++) {
+      const Rectangle &r = a[i].r;
+      if (dir ? (r.urx() <= val[dir]) : (r.ury() <= val[dir])) {
+	leq++;
       }
-      else if (_levelcount > subcell_recompute_threshold) {
-	// XXX: fixme: re-partition data structure
+      else if (dir ? (val[dir] < r.llx()) : (val[dir] < r.lly())) {
+	gt++;
       }
     }
+    straddle[dir] = n - leq - gt;
+    ok[dir] = (leq > 0 && gt > 0);
   }
+  FREE (mid);
+
+  int dir;
+  if (ok[0] && ok[1]) {
+    if (straddle[1] < straddle[0] ||
+	(straddle[1] == straddle[0] && _splitx == 0)) {
+      dir = 1;
+    }
+    else {
+      dir = 0;
+    }
+  }
+  else if (ok[1]) {
+    dir = 1;
+  }
+  else if (ok[0]) {
+    dir = 0;
+  }
+  else {
+    return false;
+  }
+  _splitx = dir;
+  _splitval = val[dir];
+  return true;
 }
-  
 
-void LayerSubcell::delSubcell (SubcellInst *s)
+/*
+ * Build the sub-tree for the subcells in a; the region must be set.
+ * a is re-ordered.
+ */
+void LayerSubcell::_build (subcell_box *a, int n)
 {
-  const Rectangle &r = s->getBBox ();
-  Assert (_region.contains (r), "What?");
-  _bbox.clear ();
-  _bloatbbox.clear();
-  if (_leq || _gt) {
+  int i, nleq, ngt;
+
+  _count = n;
+  _built = n;
+
+  nleq = 0;
+  ngt = 0;
+  if (n > subcell_level_threshold && _pickSplit (a, n)) {
+    Rectangle r;
+    _leq = new LayerSubcell (!_splitx);
+    _gt = new LayerSubcell (!_splitx);
+    r = _region;
     if (_splitx) {
-      if (_splitval < r.llx()) {
-	_gt->delSubcell (s);
-      }
-      else if (r.urx() <= _splitval) {
-	_leq->delSubcell (s);
-      }
-      else {
-	_levelcount--;
-	Assert (_lst, "What?");
-	_lst->del (s);
-	if (_levelcount == 0) {
-	  delete _lst;
-	  _lst = NULL;
-	}
-      }
+      r.setXMax (_splitval);
     }
     else {
-      if (_splitval < r.lly()) {
-	_gt->addSubcell (s);
+      r.setYMax (_splitval);
+    }
+    _leq->setRegion (r);
+    r = _region;
+    if (_splitx) {
+      r.setXMin (_splitval+1);
+    }
+    else {
+      r.setYMin (_splitval+1);
+    }
+    _gt->setRegion (r);
+
+    // order a as [ leq | this level | gt ]
+    int lo = 0, hi = n-1;
+    i = 0;
+    while (i <= hi) {
+      LayerSubcell *ch = _child (a[i].r);
+      subcell_box tmp = a[i];
+      if (ch == _leq) {
+	a[i] = a[lo];
+	a[lo] = tmp;
+	lo++;
+	i++;
       }
-      else if (r.ury() <= _splitval) {
-	_leq->addSubcell (s);
+      else if (ch == _gt) {
+	a[i] = a[hi];
+	a[hi] = tmp;
+	hi--;
       }
       else {
-	_levelcount--;
-	Assert (_lst, "What?");
-	_lst->del (s);
-	if (_levelcount == 0) {
-	  delete _lst;
-	  _lst = NULL;
-	}
+	i++;
       }
     }
+    nleq = lo;
+    ngt = n-1-hi;
+    _leq->_build (a, nleq);
+    _gt->_build (a + n - ngt, ngt);
   }
-}
-
 
+  int nhere = n - nleq - ngt;
+  if (nhere > 0) {
+    subcell_box *here = a + nleq;
+    qsort (here, nhere, sizeof (subcell_box),
+	   _splitx ? _cmp_llx : _cmp_lly);
+    MALLOC (_lst, SubcellInst *, nhere);
+    _lst_max = nhere;
+    for (i=0; i < nhere; i++) {
+      _lst[i] = here[i].c;
+    }
+    A_LEN (_lst) = nhere;
+  }
+  // the boxes of the sub-trees are already computed
+  _computeBBox ();
+}
 
 
 void LayerSubcell::_computeBBox ()
 {
-  SubcellList *l;
   _bbox.clear ();
   _bloatbbox.clear ();
   _abutbox.clear ();
-  for (l = _lst; l; l = _lst->getNext()) {
-    _bbox = _bbox ^ l->getCell()->getBBox ();
-    _bloatbbox = _bloatbbox ^ l->getCell()->getBloatBBox();
-    _abutbox = _abutbox ^ l->getCell()->getAbutBox ();
+  for (int i=0; i < A_LEN (_lst); i++) {
+    _bbox = _bbox ^ _lst[i]->getBBox ();
+    _bloatbbox = _bloatbbox ^ _lst[i]->getBloatBBox();
+    _abutbox = _abutbox ^ _lst[i]->getAbutBox ();
   }
   if (_leq) {
     _bbox = _bbox ^ _leq->getBBox();
@@ -272,14 +506,28 @@ SubcellInst::SubcellInst (LayoutBlob *b, const char *id, const char *name,
 {
   _nx = 1;
   _ny = 1;
+  _px = 0;
+  _py = 0;
   _b = b;
-  _uid = id;
-  _name = name;
+  _b->incRef ();
+  _uid = id ? Strdup (id) : NULL;
+  _name = name ? Strdup (name) : NULL;
   if (m) {
     _m = *m;
   }
 }
 
+SubcellInst::~SubcellInst ()
+{
+  LayoutBlob::decRef (_b);
+  if (_uid) {
+    FREE ((char *)_uid);
+  }
+  if (_name) {
+    FREE ((char *)_name);
+  }
+}
+
 void SubcellInst::mkArray (int nx, int pitchx, int ny, int pitchy)
 {
   _nx = nx;
@@ -288,6 +536,107 @@ void SubcellInst::mkArray (int nx, int pitchx, int ny, int pitchy)
   _py = pitchy;
 }
 
+void SubcellInst::getElemMat (int i, int j, TransformMat *res,
+			      const TransformMat *mat)
+{
+  res->mkI ();
+  res->translate ((long)i*_px, (long)j*_py);
+  res->applyMat (_m);
+  if (mat) {
+    res->applyMat (*mat);
+  }
+}
+
+Rectangle SubcellInst::getElemBBox (int i, int j)
+{
+  Rectangle r;
+  if (!_b) {
+    return r;
+  }
+  r = _b->getBBox ();
+  if (r.empty()) {
+    return r;
+  }
+  r.shiftx ((long)i*_px);
+  r.shifty ((long)j*_py);
+  return _m.applyBox (r);
+}
+
+static long _div_floor (long a, long b)
+{
+  long q = a / b;
+  if ((a % b != 0) && ((a < 0) != (b < 0))) {
+    q--;
+  }
+  return q;
+}
+
+static long _div_ceil (long a, long b)
+{
+  return -_div_floor (-a, b);
+}
+
+/*
+ * Elements k in 0..n-1 with [lo + k*p, hi + k*p] overlapping
+ * [wlo, whi]
+ */
+static bool _elem_range (long lo, long hi, long p, int n,
+			 long wlo, long whi, int *klo, int *khi)
+{
+  long a, b;
+  if (p == 0) {
+    if (hi < wlo || whi < lo) {
+      return false;
+    }
+    a = 0;
+    b = n-1;
+  }
+  else if (p > 0) {
+    a = _div_ceil (wlo - hi, p);
+    b = _div_floor (whi - lo, p);
+  }
+  else {
+    a = _div_ceil (whi - lo, p);
+    b = _div_floor (wlo - hi, p);
+  }
+  if (a < 0) {
+    a = 0;
+  }
+  if (b > n-1) {
+    b = n-1;
+  }
+  if (a > b) {
+    return false;
+  }
+  *klo = a;
+  *khi = b;
+  return true;
+}
+
+bool SubcellInst::getElemRange (const Rectangle &r, int *ilo, int *ihi,
+				int *jlo, int *jhi)
+{
+  Rectangle b, w;
+  if (!_b || r.empty()) {
+    return false;
+  }
+  b = _b->getBBox ();
+  if (b.empty()) {
+    return false;
+  }
+  // the window in the coordinates of the array
+  w = _m.applyInvBox (r);
+  if (!_elem_range (b.llx(), b.urx(), _px, _nx, w.llx(), w.urx(),
+		    ilo, ihi)) {
+    return false;
+  }
+  if (!_elem_range (b.lly(), b.ury(), _py, _ny, w.lly(), w.ury(),
+		    jlo, jhi)) {
+    return false;
+  }
+  return true;
+}
+
 LayoutEdgeAttrib *SubcellInst::getLayoutEdgeAttrib ()
 {
   LayoutEdgeAttrib *le;
@@ -300,62 +649,45 @@ LayoutEdgeAttrib *SubcellInst::getLayoutEdgeAttrib ()
   return le;
 }
 
-Rectangle SubcellInst::getBBox()
+/*
+ * Extend a box of the subcell to cover the entire array, and map it
+ * into the coordinate system of the instance
+ */
+Rectangle SubcellInst::_arrayBox (Rectangle r)
 {
-  Assert (0, "What?");
+  if (r.empty()) {
+    return r;
+  }
+  if (_nx > 1 || _ny > 1) {
+    long ax = (long)(_nx-1)*_px;
+    long ay = (long)(_ny-1)*_py;
+    r.setRectCoords (r.llx() + MIN(ax, 0), r.lly() + MIN(ay, 0),
+		     r.urx() + MAX(ax, 0), r.ury() + MAX(ay, 0));
+  }
+  return _m.applyBox (r);
+}
 
+Rectangle SubcellInst::getBBox()
+{
   Rectangle r;
   if (!_b) {
     return r;
   }
-  r = _b->getBBox ();
-  Rectangle a = _b->getAbutBox ();
-  if (a.empty()) {
-    a = r;
-  }
-
-  // XXX: this is wrong
-
-  long fringex = (a.llx() - r.llx()) + (r.urx() - a.urx());
-  long fringey = (a.lly() - r.lly()) + (r.ury() - a.ury());
-
-  r.setRectCoords (r.llx(), r.lly(), r.llx() + a.wx()*_nx + fringex,
-		   r.lly() + a.wy()*_ny + fringey);
-
-  return r;
+  return _arrayBox (_b->getBBox ());
 }
 
 Rectangle SubcellInst::getBloatBBox()
 {
-  Assert (0, "What?");
-
   Rectangle r;
   if (!_b) {
     return r;
   }
-  r = _b->getBBox ();
-  Rectangle a = _b->getAbutBox ();
-  if (a.empty()) {
-    a = r;
-  }
-  r = _b->getBloatBBox ();
-
-  // XXX: this is wrong
-
-  long fringex = (a.llx() - r.llx()) + (r.urx() - a.urx());
-  long fringey = (a.lly() - r.lly()) + (r.ury() - a.ury());
-
-  r.setRectCoords (r.llx(), r.lly(), r.llx() + a.wx()*_nx + fringex,
-		   r.lly() + a.wy()*_ny + fringey);
-
-  return r;
+  return _arrayBox (_b->getBloatBBox ());
 }
 
 
 Rectangle SubcellInst::getAbutBox ()
 {
-  Assert (0, "What?");
-
   Rectangle r;
   if (!_b) {
     return r;
@@ -364,9 +696,7 @@ Rectangle SubcellInst::getAbutBox ()
   if (r.empty()) {
     return getBBox();
   }
-  // XXX: this is wrong
-  r.setRect (r.llx(), r.lly(), r.wx()*_nx, r.wy()*_ny);
-  return r;
+  return _arrayBox (r);
 }
 
 
@@ -387,120 +717,3 @@ void SubcellInst::PrintRect (FILE *fp, TransformMat *mat)
   }
   fprintf (fp, "\n");
 }
-
-
-void SubcellList::append (SubcellInst *c, bool sort_x)
-{
-  SubcellList *tmp = new SubcellList (c);
-  SubcellList *prev,  *cur;
-
-  prev = NULL;
-  cur = this;
-  while (cur) {
-    bool gonext;
-    if (sort_x) {
-      if (cur->_cell->getBBox().urx() < c->getBBox().llx()) {
-	gonext = true;
-      }
-      else {
-	gonext = false;
-      }
-    }
-    else {
-      if (cur->_cell->getBBox().ury() < c->getBBox().lly()) {
-	gonext = true;
-      }
-      else {
-	gonext = false;
-      }
-    }
-    if (gonext) {
-      prev = cur;
-      cur = cur->_next;
-    }
-    else {
-      if (!prev) {
-	SubcellInst *x;
-	tmp->_next = _next;
-	_next = tmp;
-	tmp->_cell = _cell;
-	_cell = c;
-	return;
-      }
-      else {
-	prev->_next = tmp;
-	tmp->_next = cur;
-	return;
-      }
-    }
-  }
-  prev->_next = tmp;
-}
-
-SubcellList *SubcellList::del (SubcellInst *c)
-{
-  SubcellList *prev, *cur;
-
-  prev = NULL;
-  cur = this;
-  while (cur) {
-    if (cur->_cell == c) {
-      break;
-    }
-    else {
-      prev = cur;
-      cur = cur->_next;
-    }
-  }
-  if (cur) {
-    if (prev) {
-      prev->_next = cur->_next;
-      delete cur;
-      return this;
-    }
-    else {
-      cur = cur->_next;
-      delete this;
-      return cur;
-    }
-  }
-  return this;
-}
-
-SubcellList *SubcellList::flushClear ()
-{
-  SubcellList *tmp, *prev, *cur;
-  prev = NULL;
-  cur = this;
-  while (cur) {
-    if (!cur->_cell) {
-      if (prev) {
-	prev->_next = cur->_next;
-	tmp = cur;
-	cur = cur->_next;
-	delete tmp;
-      }
-      else {
-	if (cur->_next) {
-	  tmp = cur->_next;
-	  cur->_cell = tmp->_cell;
-	  cur->_next = tmp->_next;
-	  delete tmp;
-	  cur = cur->_next;
-	}
-	else {
-	  delete this;
-	  return NULL;
-	}
-      }
-    }
-    else {
-      prev = cur;
-      cur = cur->_next;
-    }
-  }
-  if (!prev) {
-    return NULL;
-  }
-  return this;
-}
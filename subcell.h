@@ -34,15 +34,36 @@ private:
   int _nx, _ny;			//< array size
   int _px, _py;			//< x,y pitch
 
+  Rectangle _arrayBox (Rectangle r);
+
 public:
-  /** We use aliases for the id and name pointers, so they should be
-      persistent pointers.
+  /** The id and name are copied. The instance holds a reference to
+      the subcell layout b, which is shared by all its instances.
   **/
   SubcellInst (LayoutBlob *b, const char *id, const char *name,
 	       TransformMat *m = NULL);
+  ~SubcellInst ();
 
   void mkArray (int nx, int pitchx, int ny, int pitchy);
 
+  LayoutBlob *getBlob () { return _b; }
+  int getNX () { return _nx; }
+  int getNY () { return _ny; }
+
+  /* transformation for array element (i,j), followed by mat if
+     specified */
+  void getElemMat (int i, int j, TransformMat *res,
+		   const TransformMat *mat = NULL);
+
+  /* bounding box of array element (i,j) */
+  Rectangle getElemBBox (int i, int j);
+
+  /* the range of array elements whose bounding box overlaps r, as
+     ilo..ihi and jlo..jhi (inclusive); returns false if there are
+     none. r is in the same coordinates as getBBox(). */
+  bool getElemRange (const Rectangle &r, int *ilo, int *ihi,
+		     int *jlo, int *jhi);
+
   LayoutEdgeAttrib *getLayoutEdgeAttrib ();
 
   Rectangle getBBox();
@@ -52,34 +73,7 @@ public:
   void PrintRect (FILE *fp, TransformMat *mat);
 };
 
-class SubcellList {
- private:
-  SubcellList *_next;		/* linked-list of subcells */
-  SubcellInst *_cell;		/* actual subcell */
- public:
-  
-  SubcellList (SubcellInst *c) {
-    _cell = c;
-    _next = NULL;
-  }
-  
-  ~SubcellList () {
-    if (_next) {
-      delete _next;
-    }
-    if (_cell) {
-      delete _cell;
-    }
-  }
-
-  void append (SubcellInst *c, bool sort_x);
-  SubcellList *del (SubcellInst *c);
-  SubcellList *getNext() { return _next; }
-  SubcellInst *getCell() { return _cell; }
-  void clearCell() { _cell = NULL; }
-  SubcellList *flushClear();
-};
-
+struct subcell_box;
 
 /*
  * Recursively partition space
@@ -87,7 +81,9 @@ class SubcellList {
 class LayerSubcell {
 
  private:
-  unsigned int _splitx:1;   /* 1 if my split was in the x-direction */
+  unsigned int _splitx:1;   /* 1 if my split was in the x-direction;
+			       the subcells here are sorted in the
+			       same direction */
   long _splitval:62;	    /* location of split. the split
 			       coordinate is in the "_leq" box. */
   Rectangle _region;	    /* owned region */
@@ -95,12 +91,28 @@ class LayerSubcell {
   Rectangle _bloatbbox;	    /* bloated bbox */
   Rectangle _abutbox;	    /* abutment box */
   LayerSubcell *_leq, *_gt; /* split tile */
-  SubcellList *_lst;	    /* list of subcells here */
-  int _levelcount;	    /* list length */
+  A_DECL (SubcellInst *, _lst); /* subcells here, sorted by llx
+				   (_splitx) or lly */
+  int _count;		    /* # of subcells in this sub-tree */
+  int _built;		    /* _count when the sub-tree was last
+			       partitioned */
 
 
   void _computeBBox();
 
+  long _key (SubcellInst *s) {
+    return _splitx ? s->getBBox().llx() : s->getBBox().lly();
+  }
+  void _lstAdd (SubcellInst *s);
+  void _lstDel (SubcellInst *s);
+
+  LayerSubcell *_child (const Rectangle &r);
+  bool _needRepartition ();
+  void _repartition (SubcellInst **extra = NULL, int n = 0);
+  void _collect (SubcellInst **a, int *n);
+  void _build (subcell_box *a, int n);
+  bool _pickSplit (subcell_box *a, int n);
+
  public:
 
   static int subcell_level_threshold; // if you exceed this threshold,
@@ -116,36 +128,53 @@ class LayerSubcell {
     _splitval = 0;
     _leq = NULL;
     _gt = NULL;
-    _lst = NULL;
-    _levelcount = 0;
+    A_INIT (_lst);
+    _count = 0;
+    _built = 0;
   }
 
-  ~LayerSubcell() {
-    if (_leq) {
-      delete _leq;
-    }
-    if (_gt) {
-      delete _gt;
-    }
-    if (_lst) {
-      delete _lst;
-    }
-  }
+  ~LayerSubcell();		// deletes the subcells as well
 
   void initGlobal() {
-    if (_leq || _gt || _lst) {
+    if (_leq || _gt || A_LEN (_lst) > 0) {
       fatal_error ("LayerSubcell:: initGlobal() called after subcells were added!");
     }
-    _region.setRect (MIN_VALUE, MIN_VALUE, MAX_VALUE, MAX_VALUE);
+    // the widths wrap around: this is (MIN_VALUE,MIN_VALUE) to
+    // (MAX_VALUE-1,MAX_VALUE-1)
+    _region.setRect (MIN_VALUE, MIN_VALUE, ~0UL, ~0UL);
   }
 
   void setRegion (Rectangle &r) {
     _region = r;
   }
 
+  /* the tree takes ownership of added subcells */
   void addSubcell (SubcellInst *s);
   void delSubcell (SubcellInst *s);
 
+  /*
+   * Add n subcells at once. The tree is re-built from scratch in
+   * O(n log n) time, rather than by n calls to addSubcell().
+   */
+  void addSubcells (SubcellInst **a, int n);
+
+  /*
+   * Re-partition the entire tree, splitting each sub-tree at the
+   * median of the subcells in it. addSubcell() does this for a
+   * sub-tree once it becomes unbalanced; this can be used after a
+   * batch of changes.
+   */
+  void rebalance ();
+
+  int getCount () { return _count; }
+
+  /*
+   * Call f (cookie, s) for each subcell s whose bounding box overlaps
+   * r. Sub-trees outside r are skipped.
+   */
+  void query (const Rectangle &r, void *cookie,
+	      void (*f) (void *, SubcellInst *));
+
   Rectangle getBBox ();
   Rectangle getBloatBBox ();
   Rectangle getAbutBox();
@@ -155,6 +155,17 @@ public:
     fprintf (fp, "(%ld,%ld) -> (%ld,%ld)", llx(), lly(), urx(), ury());
   }
 
+  bool overlaps (const Rectangle &r) const {
+    if (empty() || r.empty()) {
+      return false;
+    }
+    if (r.urx() < llx() || urx() < r.llx() ||
+	r.ury() < lly() || ury() < r.lly()) {
+      return false;
+    }
+    return true;
+  }
+
   bool contains (const Rectangle &r) const {
     if (llx() <= r.llx() && lly() <= r.lly() &&
 	r.urx() <= urx() && r.ury() <= ury()) {